@@ -0,0 +1,816 @@
+//! The benchmarks for the collector.  Each workload runs in a process of its own, so that their peak
+//! resident sizes are their own, and prints one line of JSON with what it measured:
+//!
+//!     ./bench [--concurrent] [--mark-threads N] [--nursery BYTES] [--huge-pages] [--evacuate] [--conservative]
+//!         [--threads N] [--graph FILE] [workload...]
+//!
+//! With no workloads named, all of them are run.
+
+#define CHOMPACT_NO_MAIN
+#include "chompact.cpp"
+
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//! What a workload did, and how long the collector stopped it for
+struct Measurements
+{
+	Measurements()
+		: m_allocations(0)
+		, m_bytesAllocated(0)
+		, m_minorPauses(0)
+		, m_fullPauses(0)
+		, m_slices(0)
+	{
+	}
+
+	size_t m_allocations;
+	size_t m_bytesAllocated;
+	size_t m_minorPauses;
+	size_t m_fullPauses;
+	size_t m_slices;
+	std::vector<double> m_pauses;
+};
+
+Measurements measurements;
+
+//! The number of mutator threads that the threads workload runs
+size_t mutators = 4;
+
+//! Where the census workload dumps the object graph, if anywhere
+const char* graphFile = 0;
+
+//! Fails the workload when what it computed is wrong.  The benchmarks are built with NDEBUG, so the
+//! checks can't be asserts, or a collector that loses objects would still report its timings.
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			exit(1); \
+		} \
+	} \
+	while (0)
+
+void observe(const Pause& pause, void*)
+{
+	measurements.m_pauses.push_back(pause.m_seconds);
+	if (pause.m_kind == Pause::Minor)
+		++measurements.m_minorPauses;
+	else if (pause.m_kind == Pause::Full)
+		++measurements.m_fullPauses;
+	else
+		++measurements.m_slices;
+}
+
+//! Allocates an object, counting it towards the allocation rate.  The object may move at the next
+//! allocation, so it has to be stored in a handle or a member before then.
+template<typename Class>
+Collected<Class>* make(Heap& heap)
+{
+	++measurements.m_allocations;
+	measurements.m_bytesAllocated += sizeof(Collected<Class>);
+	return new (heap) Collected<Class>;
+}
+
+// GCBench, after Hans Boehm's: short lived binary trees of increasing depth, built both top down and
+// bottom up, next to a long lived tree and array
+
+struct Node
+{
+	Member<Node, Node> left, right;
+	int i, j;
+};
+
+CHOMPACT_TRACE(Node, left, right)
+
+struct Doubles
+{
+	double values[500000];
+};
+
+CHOMPACT_TRACE(Doubles)
+
+size_t treeSize(int depth)
+{
+	return (size_t(1) << (depth + 1)) - 1;
+}
+
+void populate(Heap& heap, int depth, const Handle<Node>& node)
+{
+	if (depth <= 0)
+		return;
+
+	HandleScope scope(heap);
+	Collected<Node>* left = make<Node>(heap);
+	node->left = left;
+	Collected<Node>* right = make<Node>(heap);
+	node->right = right;
+
+	populate(heap, depth - 1, Handle<Node>(node->left.collected()));
+	populate(heap, depth - 1, Handle<Node>(node->right.collected()));
+}
+
+Collected<Node>* makeTree(Heap& heap, int depth)
+{
+	if (depth <= 0)
+		return make<Node>(heap);
+
+	HandleScope scope(heap);
+	Handle<Node> left(makeTree(heap, depth - 1));
+	Handle<Node> right(makeTree(heap, depth - 1));
+	Collected<Node>* node = make<Node>(heap);
+	node->instance.left = left;
+	node->instance.right = right;
+	return node;
+}
+
+void gcbench(Heap& heap)
+{
+	const int StretchTreeDepth = 18;
+	const int LongLivedTreeDepth = 16;
+	const int MinTreeDepth = 4;
+	const int MaxTreeDepth = 16;
+
+	{
+		HandleScope scope(heap);
+		Handle<Node> stretch(makeTree(heap, StretchTreeDepth));
+	}
+
+	Handle<Node> longLived(make<Node>(heap));
+	populate(heap, LongLivedTreeDepth, longLived);
+
+	Handle<Doubles> array(make<Doubles>(heap));
+	for (size_t i = 0; i < sizeof(array->values) / sizeof(array->values[0]) / 2; ++i)
+		array->values[i] = 1.0 / i;
+
+	for (int depth = MinTreeDepth; depth <= MaxTreeDepth; depth += 2)
+	{
+		size_t iterations = 2 * treeSize(StretchTreeDepth) / treeSize(depth);
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			HandleScope scope(heap);
+			Handle<Node> topDown(make<Node>(heap));
+			populate(heap, depth, topDown);
+		}
+		for (size_t i = 0; i < iterations; ++i)
+		{
+			HandleScope scope(heap);
+			Handle<Node> bottomUp(makeTree(heap, depth));
+		}
+	}
+
+	CHECK(longLived && array->values[1000] == 1.0 / 1000);
+}
+
+// Lists: a window of linked lists, the oldest of which is replaced by a new one at every step, while
+// the survivors have their elements spliced out and replaced
+
+void lists(Heap& heap)
+{
+	const size_t Lists = 200;
+	const size_t Length = 1000;
+	const size_t Steps = 20000;
+
+	std::mt19937 random(1);
+	std::vector<Handle<List> > window(Lists);
+	for (size_t step = 0; step < Steps; ++step)
+	{
+		HandleScope scope(heap);
+
+		// Replace the oldest list
+		Handle<List> head(make<List>(heap));
+		head->data = step;
+		for (size_t i = 1; i < Length; ++i)
+		{
+			Collected<List>* l = make<List>(heap);
+			l->instance.data = step;
+			l->instance.next = head;
+			head = l;
+		}
+		window[step % Lists] = head;
+
+		// Replace an element in the middle of a surviving list with a fresh one
+		Handle<List> list(window[random() % std::min(step + 1, Lists)]);
+		for (size_t i = random() % (Length / 2); i; --i)
+			list = list->next;
+		Collected<List>* l = make<List>(heap);
+		l->instance.data = list->next->data;
+		l->instance.next = list->next->next;
+		list->next = l;
+	}
+
+	for (size_t i = 0; i < Lists; ++i)
+	{
+		size_t length = 0;
+		for (Handle<List> list(window[i]); list; list = list->next)
+			++length;
+		CHECK(length == Length);
+	}
+}
+
+// LRU: a cache of payloads, indexed by a hash table big enough to be a large object and ordered by a
+// doubly linked list, with keys drawn so that about a third of the lookups miss
+
+struct Payload
+{
+	char data[96];
+};
+
+CHOMPACT_TRACE(Payload)
+
+struct Entry
+{
+	size_t key;
+	Member<Entry, Entry> chain, previous, next;
+	Member<Entry, Payload> payload;
+};
+
+CHOMPACT_TRACE(Entry, chain, previous, next, payload)
+
+struct Table
+{
+	Member<Table, Entry> buckets[1 << 15];
+};
+
+struct Cache
+{
+	Member<Cache, Table> table;
+	Member<Cache, Entry> head, tail;
+	size_t size;
+};
+
+CHOMPACT_TRACE(Cache, table, head, tail)
+
+const size_t Buckets = sizeof(Table) / sizeof(Member<Table, Entry>);
+
+void detach(Cache& cache, Entry& entry)
+{
+	if (entry.previous)
+		entry.previous->next = entry.next;
+	else
+		cache.head = entry.next;
+	if (entry.next)
+		entry.next->previous = entry.previous;
+	else
+		cache.tail = entry.previous;
+}
+
+void pushFront(Cache& cache, Collected<Entry>* entry)
+{
+	entry->instance.previous = 0;
+	entry->instance.next = cache.head;
+	if (cache.head)
+		cache.head->previous = entry;
+	else
+		cache.tail = entry;
+	cache.head = entry;
+}
+
+void lru(Heap& heap)
+{
+	const size_t Capacity = 100000;
+	const size_t Lookups = 4000000;
+
+	Handle<Cache> cache(make<Cache>(heap));
+	Collected<Table>* table = make<Table>(heap);
+	cache->table = table;
+	cache->size = 0;
+
+	std::mt19937 random(1);
+	std::uniform_int_distribution<size_t> keys(0, Capacity * 3 / 2);
+	size_t hits = 0;
+	for (size_t i = 0; i < Lookups; ++i)
+	{
+		size_t key = keys(random);
+		Member<Table, Entry>& bucket = cache->table->buckets[key % Buckets];
+
+		Collected<Entry>* entry = bucket.collected();
+		while (entry && entry->instance.key != key)
+			entry = entry->instance.chain.collected();
+		if (entry)
+		{
+			++hits;
+			detach(*cache, entry->instance);
+			pushFront(*cache, entry);
+			continue;
+		}
+
+		if (cache->size == Capacity)
+		{
+			// Evict the least recently used entry from the list and from its bucket
+			Entry& evicted = *cache->tail;
+			detach(*cache, evicted);
+
+			Member<Table, Entry>& first = cache->table->buckets[evicted.key % Buckets];
+			Collected<Entry>* previous = 0;
+			for (Collected<Entry>* e = first.collected(); &e->instance != &evicted; e = e->instance.chain.collected())
+				previous = e;
+			if (previous)
+				previous->instance.chain = evicted.chain;
+			else
+				first = evicted.chain;
+			--cache->size;
+		}
+
+		HandleScope scope(heap);
+		Handle<Entry> added(make<Entry>(heap));
+		Collected<Payload>* payload = make<Payload>(heap);
+		added->payload = payload;
+		added->key = key;
+
+		Member<Table, Entry>& head = cache->table->buckets[key % Buckets];
+		added->chain = head;
+		head = added;
+		pushFront(*cache, added.collected());
+		++cache->size;
+	}
+
+	CHECK(hits > Lookups / 2 && cache->size == Capacity);
+}
+
+// Handles: a large set of long lived handles, some of them replaced at every step, next to bursts of
+// short lived ones inside of and outside of HandleScopes
+
+void handles(Heap& heap)
+{
+	const size_t LongLived = 200000;
+	const size_t Steps = 2000;
+	const size_t Burst = 1000;
+
+	// Each long lived handle holds the step it was last replaced at
+	std::mt19937 random(1);
+	std::vector<Handle<List> > roots;
+	std::vector<size_t> replaced(LongLived, 0);
+	for (size_t i = 0; i < LongLived; ++i)
+	{
+		roots.push_back(Handle<List>(make<List>(heap)));
+		roots.back()->data = 0;
+	}
+
+	for (size_t step = 0; step < Steps; ++step)
+	{
+		for (size_t i = 0; i < Burst / 10; ++i)
+		{
+			size_t r = random() % LongLived;
+			roots[r] = make<List>(heap);
+			roots[r]->data = replaced[r] = step;
+		}
+
+		{
+			HandleScope scope(heap);
+			for (size_t i = 0; i < Burst; ++i)
+			{
+				Handle<List> temporary(make<List>(heap));
+				temporary->next = roots[i];
+			}
+		}
+
+		std::vector<Handle<List> > temporaries;
+		for (size_t i = 0; i < Burst; ++i)
+			temporaries.push_back(Handle<List>(make<List>(heap)));
+	}
+
+	for (size_t i = 0; i < LongLived; ++i)
+		CHECK(size_t(roots[i]->data) == replaced[i]);
+}
+
+// Weak: weak handles to every object of a window that is held strongly for a step and then dropped.
+// A handle has to keep finding its object for as long as the object is held, and be cleared, with
+// its callback called, once it no longer is.
+
+void countCleared(void* cleared)
+{
+	++*static_cast<size_t*>(cleared);
+}
+
+void weak(Heap& heap)
+{
+	const size_t Window = 1000;
+	const size_t Steps = 200;
+	const size_t Garbage = 20000;
+
+	size_t cleared = 0;
+	std::vector<Handle<List> > strong(Window);
+	std::vector<WeakHandle<List> > weak;
+	weak.reserve(Window * Steps);
+	for (size_t step = 0; step < Steps; ++step)
+	{
+		for (size_t i = 0; i < Window; ++i)
+		{
+			strong[i] = make<List>(heap);
+			strong[i]->data = weak.size();
+			weak.push_back(WeakHandle<List>(strong[i].collected(), countCleared, &cleared));
+		}
+
+		for (size_t i = 0; i < Garbage; ++i)
+			make<List>(heap);
+
+		// The window is still held, and the handles to the objects dropped before it either have been
+		// cleared or still find the objects they were made for
+		for (size_t i = 0; i < Window; ++i)
+			CHECK(weak[step * Window + i].collected() == strong[i].collected());
+		for (size_t i = 0; i < weak.size(); ++i)
+			CHECK(!weak[i] || size_t(weak[i].collected()->instance.data) == i);
+	}
+
+	// Collect twice, since a collection finishing a concurrent one keeps what its snapshot held
+	strong.clear();
+	heap.collect();
+	heap.collect();
+
+	// A conservative heap may find stale pointers to a few of the objects in the stack
+	size_t remaining = 0;
+	for (size_t i = 0; i < weak.size(); ++i)
+		remaining += bool(weak[i]);
+	CHECK(remaining <= (heap.policy().m_conservative ? Window / 100 : 0));
+	CHECK(cleared + remaining == weak.size());
+}
+
+// Threads: several mutators, started and joined in rounds so that threads also exit and attach anew,
+// build lists and swap them with the ones the others built on a shared board.  The board's lock is
+// taken inside a SafeRegion, since a thread waiting for it can't stop for a pause.
+
+struct Board
+{
+	Member<Board, List> lists[256];
+};
+
+const size_t BoardSlots = sizeof(Board) / sizeof(Member<Board, List>);
+
+//! Whether list is one whole list of the length the mutators build, every element of which holds the
+//! same tag
+bool intact(Collected<List>* list, size_t length)
+{
+	int tag = list->instance.data;
+	for (size_t i = 0; i < length; ++i, list = list->instance.next.collected())
+	{
+		if (!list || list->instance.data != tag)
+			return false;
+	}
+	return !list;
+}
+
+void mutate(Heap& heap, const Handle<Board>& board, std::mutex& lock, size_t thread, size_t& allocations)
+{
+	const size_t Steps = 2000;
+	const size_t Length = 100;
+
+	std::mt19937 random(thread);
+	for (size_t step = 0; step < Steps; ++step)
+	{
+		HandleScope scope(heap);
+		int tag = thread * Steps + step;
+		Handle<List> list(new (heap) Collected<List>);
+		list->data = tag;
+		for (size_t i = 1; i < Length; ++i)
+		{
+			Collected<List>* l = new (heap) Collected<List>;
+			l->instance.data = tag;
+			l->instance.next = list;
+			list = l;
+		}
+		allocations += Length;
+
+		{
+			SafeRegion region(heap);
+			lock.lock();
+		}
+		Member<Board, List>& slot = board->lists[random() % BoardSlots];
+		Collected<List>* previous = slot.collected();
+		CHECK(!previous || intact(previous, Length));
+		slot = list;
+		lock.unlock();
+
+		// Block now and again, as a thread waiting on I/O would
+		if (step % 100 == 0)
+		{
+			SafeRegion region(heap);
+			std::this_thread::yield();
+		}
+	}
+}
+
+void threads(Heap& heap)
+{
+	const size_t Rounds = 4;
+	const size_t Length = 100;
+
+	Handle<Board> board(make<Board>(heap));
+	std::mutex lock;
+	std::vector<size_t> allocations(mutators, 0);
+	for (size_t round = 0; round < Rounds; ++round)
+	{
+		std::vector<std::thread> running;
+		for (size_t t = 0; t < mutators; ++t)
+			running.push_back(std::thread(mutate, std::ref(heap), std::cref(board), std::ref(lock), round * mutators + t, std::ref(allocations[t])));
+
+		SafeRegion region(heap);
+		for (size_t t = 0; t < mutators; ++t)
+			running[t].join();
+	}
+
+	for (size_t t = 0; t < mutators; ++t)
+	{
+		measurements.m_allocations += allocations[t];
+		measurements.m_bytesAllocated += allocations[t] * sizeof(Collected<List>);
+	}
+
+	heap.collect();
+	for (size_t i = 0; i < BoardSlots; ++i)
+		CHECK(!board->lists[i] || intact(board->lists[i].collected(), Length));
+}
+
+// Incremental: collections done in small slices with collectIncremental, in between which the
+// mutator moves elements from list to list, inserts new ones and cuts lists short.  A model of the
+// lists kept alongside has to match them after every collection.
+
+//! The element at position of list, which has to have at least position + 1 elements
+Collected<List>* at(const Handle<List>& list, size_t position)
+{
+	Collected<List>* element = list.collected();
+	for (; position; --position)
+		element = element->instance.next.collected();
+	return element;
+}
+
+void incremental(Heap& heap)
+{
+	const size_t Lists = 100;
+	const size_t Length = 200;
+	const size_t Collections = 50;
+	const size_t Budget = 200;
+	const size_t Stores = 20;
+
+	std::mt19937 random(1);
+	std::vector<Handle<List> > lists(Lists);
+	std::vector<std::deque<int> > model(Lists);
+	int tag = 0;
+	for (size_t i = 0; i < Lists; ++i)
+	{
+		for (size_t j = 0; j < Length; ++j)
+		{
+			Collected<List>* l = make<List>(heap);
+			l->instance.data = tag;
+			l->instance.next = lists[i];
+			lists[i] = l;
+			model[i].push_front(tag++);
+		}
+	}
+
+	for (size_t collection = 0; collection < Collections; ++collection)
+	{
+		bool finished = false;
+		while (!finished)
+		{
+			finished = heap.collectIncremental(Budget);
+			for (size_t store = 0; store < Stores; ++store)
+			{
+				size_t from = random() % Lists;
+				size_t to = random() % Lists;
+				switch (random() % 3)
+				{
+				case 0:
+					// Move the first element of one list to the front of another
+					if (model[from].empty())
+						break;
+					{
+						Handle<List> moved(lists[from]);
+						lists[from] = moved->next.collected();
+						moved->next = lists[to];
+						lists[to] = moved;
+					}
+					model[to].push_front(model[from].front());
+					model[from].pop_front();
+					break;
+
+				case 1:
+					// Insert a new element after a random one
+					if (model[to].empty())
+						break;
+					{
+						size_t position = random() % model[to].size();
+						Collected<List>* l = make<List>(heap);
+						l->instance.data = tag;
+						Collected<List>* previous = at(lists[to], position);
+						l->instance.next = previous->instance.next;
+						previous->instance.next = l;
+						model[to].insert(model[to].begin() + position + 1, tag++);
+					}
+					break;
+
+				case 2:
+					// Cut a list short, leaving its tail garbage
+					if (model[to].size() < Length / 2)
+						break;
+					{
+						size_t position = Length / 4 + random() % (model[to].size() - Length / 4);
+						at(lists[to], position)->instance.next = 0;
+						model[to].resize(position + 1);
+					}
+					break;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < Lists; ++i)
+		{
+			Collected<List>* l = lists[i].collected();
+			for (size_t j = 0; j < model[i].size(); ++j, l = l->instance.next.collected())
+				CHECK(l && l->instance.data == model[i][j]);
+			CHECK(!l);
+		}
+	}
+}
+
+// Census: a heap of known contents, whose census has to count exactly the objects that are reachable
+// after a collection, both of a type with references and of one without.  With --graph FILE, the
+// graph is dumped there too for graph2dot to read, which has to count the same objects again.
+
+//! The objects of type that the heap's last census counted
+template<typename Class>
+size_t counted(Heap& heap)
+{
+	std::vector<CensusEntry> census = heap.census();
+	for (size_t i = 0; i < census.size(); ++i)
+	{
+		if (census[i].m_type == &Collected<Class>::info)
+			return census[i].m_objects;
+	}
+	return 0;
+}
+
+void census(Heap& heap)
+{
+	const size_t Length = 10000;
+	const size_t Payloads = 1000;
+	const size_t Garbage = 10;
+
+	// The census has to be on from the start, so the workload uses a heap of its own
+	HeapPolicy policy = heap.policy();
+	policy.m_census = true;
+	Heap counting(policy);
+	counting.observe(observe, 0);
+
+	Handle<List> list;
+	std::vector<Handle<Payload> > payloads;
+	for (size_t i = 0; i < Length; ++i)
+	{
+		Collected<List>* l = make<List>(counting);
+		l->instance.next = list;
+		list = l;
+		for (size_t j = 0; j < Garbage; ++j)
+		{
+			make<List>(counting);
+			make<Payload>(counting);
+		}
+		if (i < Payloads)
+			payloads.push_back(Handle<Payload>(make<Payload>(counting)));
+	}
+
+	// Collect twice, since a collection finishing a concurrent one doesn't count the objects
+	// allocated while it marked.  A conservative heap may find stale pointers to a few of the
+	// garbage objects in the stack.
+	counting.collect();
+	counting.collect();
+	size_t slack = counting.policy().m_conservative ? Length / 100 : 0;
+	CHECK(counted<List>(counting) >= Length && counted<List>(counting) <= Length + slack);
+	CHECK(counted<Payload>(counting) >= Payloads && counted<Payload>(counting) <= Payloads + slack);
+
+	if (graphFile)
+	{
+		FILE* file = fopen(graphFile, "wb");
+		CHECK(file);
+		counting.dumpGraph(file);
+		CHECK(!fclose(file));
+		CHECK(counted<List>(counting) >= Length && counted<List>(counting) <= Length + slack);
+	}
+}
+
+struct Workload
+{
+	const char* m_name;
+	void (*m_run)(Heap& heap);
+};
+
+const Workload Workloads[] =
+{
+	{ "gcbench", gcbench },
+	{ "lists", lists },
+	{ "lru", lru },
+	{ "handles", handles },
+	{ "weak", weak },
+	{ "threads", threads },
+	{ "incremental", incremental },
+	{ "census", census },
+};
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+void run(const Workload& workload, const HeapPolicy& policy)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	HeapStats stats;
+	{
+		Heap heap(policy);
+		heap.observe(observe, 0);
+		workload.m_run(heap);
+		stats = heap.stats();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<double> pauses = measurements.m_pauses;
+	std::sort(pauses.begin(), pauses.end());
+	double gcSeconds = 0;
+	for (size_t i = 0; i < pauses.size(); ++i)
+		gcSeconds += pauses[i];
+
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("{\"workload\": \"%s\", \"seconds\": %.6f, \"allocations\": %zu, \"bytes_allocated\": %zu, "
+		"\"allocation_mb_per_second\": %.1f, \"gc_seconds\": %.6f, \"minor_pauses\": %zu, \"full_pauses\": %zu, "
+		"\"slices\": %zu, \"pause_p50_ms\": %.3f, \"pause_p99_ms\": %.3f, \"pause_max_ms\": %.3f, "
+		"\"root_seconds\": %.6f, \"mark_seconds\": %.6f, \"sweep_seconds\": %.6f, \"peak_rss_kb\": %ld}\n",
+		workload.m_name, seconds, measurements.m_allocations, measurements.m_bytesAllocated,
+		measurements.m_bytesAllocated / seconds / (1 << 20), gcSeconds, measurements.m_minorPauses,
+		measurements.m_fullPauses, measurements.m_slices, percentile(pauses, 0.5) * 1000,
+		percentile(pauses, 0.99) * 1000, (pauses.empty() ? 0 : pauses.back()) * 1000,
+		stats.m_rootSeconds, stats.m_markSeconds, stats.m_sweepSeconds, usage.ru_maxrss);
+	fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	HeapPolicy policy;
+	std::vector<const Workload*> selected;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--concurrent")
+			policy.m_concurrent = true;
+		else if (arg == "--mark-threads" && i + 1 < argc)
+			policy.m_markThreads = strtoul(argv[++i], 0, 10);
+		else if (arg == "--nursery" && i + 1 < argc)
+			policy.m_nurserySize = strtoul(argv[++i], 0, 10);
+		else if (arg == "--huge-pages")
+			policy.m_hugePages = TransparentHugePages;
+		else if (arg == "--evacuate")
+			policy.m_evacuate = true;
+		else if (arg == "--conservative")
+			policy.m_conservative = true;
+		else if (arg == "--threads" && i + 1 < argc)
+			mutators = strtoul(argv[++i], 0, 10);
+		else if (arg == "--graph" && i + 1 < argc)
+			graphFile = argv[++i];
+		else
+		{
+			size_t w = 0;
+			while (w < sizeof(Workloads) / sizeof(Workloads[0]) && arg != Workloads[w].m_name)
+				++w;
+			if (w == sizeof(Workloads) / sizeof(Workloads[0]))
+			{
+				fprintf(stderr, "unknown workload %s\n", argv[i]);
+				return 1;
+			}
+			selected.push_back(&Workloads[w]);
+		}
+	}
+	if (selected.empty())
+	{
+		for (size_t w = 0; w < sizeof(Workloads) / sizeof(Workloads[0]); ++w)
+			selected.push_back(&Workloads[w]);
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < selected.size(); ++i)
+	{
+		pid_t child = fork();
+		if (!child)
+		{
+			run(*selected[i], policy);
+			return 0;
+		}
+
+		int status;
+		waitpid(child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+		{
+			fprintf(stderr, "%s failed\n", selected[i]->m_name);
+			failed = 1;
+		}
+	}
+	return failed;
+}
@@ -27,19 +27,26 @@
 //! information necessary to traverse the object graph can be dynamically determined
 //! at runtime using C++ template metaprogramming.
 
-// TODO output object graph to DOT
-
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
-#include <stack>
+#include <map>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <typeinfo>
 #include <vector>
+#include <pthread.h>
 #include <sys/mman.h>
-
-#ifndef NDEBUG
-#include <typeinfo>
-#endif
+#include <ucontext.h>
 
 const size_t PageSize = 4096;
 
@@ -47,510 +54,4325 @@ const size_t PageSize = 4096;
 #define DIVU(N, D) (N + D - 1) / (D)
 
 class Heap;
+class HandleScope;
+class WeakHandleBase;
 class CollectedBase;
 template<typename Class> class Collected;
 template<typename Class> class Handle;
 
-//! All heap objects are allocated on a DataPage.  DataPages are convenient, because since they are aligned
-//! the static information on the data page can be accessed by any pointer allocated within the DataPage
-//! without any additional space overhead.
+//! How the memory of a heap is backed: by regular pages, by transparent huge pages that the kernel
+//! assembles when it can, or by huge pages from the pool reserved for them, falling back to regular
+//! pages when the pool runs dry
+enum HugePages { NoHugePages, TransparentHugePages, ExplicitHugePages };
+
+//! A range of address space reserved up front, which all of the pages of a heap are carved out of.
+//! It's committed a chunk the size of a huge page at a time, so growing the heap doesn't take a
+//! system call and a mapping for every page, and the heap's pages stay next to each other where huge
+//! pages can back them.
+//!
+//! The reservation is a hard cap that the region never grows past.  Running out of it, or the
+//! system refusing to reserve or commit it, aborts the process: pages are allocated in the middle
+//! of collections, which can't be unwound.
+class Region
+{
+public:
+	static const size_t ChunkSize = 2 << 20;
+	static const size_t ChunkPages = ChunkSize / PageSize;
+
+	Region(size_t size, HugePages hugePages);
+	~Region();
+
+	void* allocate(size_t pages);
+
+	//! Gives pages back to the region.  Their memory goes back to the system right away with regular
+	//! pages, and once the whole of their chunk is free with huge pages, which splitting would undo.
+	void release(void* p, size_t pages);
+
+	char* base() const
+	{
+		return m_base;
+	}
+
+private:
+	void commit(size_t chunks);
+	void used(size_t first, size_t pages, bool allocated);
+
+	//! Reports why the region can't go on, and aborts
+	static void fail(const char* what, int error) __attribute__((noreturn));
+
+	std::mutex m_lock;
+	char* m_base;
+	size_t m_size;
+	HugePages m_hugePages;
+
+	//! The pages handed out from the start of the region so far, and the chunks committed
+	size_t m_top;
+	size_t m_committed;
+
+	//! The runs of pages given back below m_top by their first page, which are handed out again
+	//! first fit
+	std::map<size_t, size_t> m_free;
+
+	//! With huge pages, the number of pages in use in each committed chunk
+	std::vector<size_t> m_chunkPages;
+};
+
+Region::Region(size_t size, HugePages hugePages)
+	: m_size(DIVU(size, ChunkSize) * ChunkSize)
+	, m_hugePages(hugePages)
+	, m_top(0)
+	, m_committed(0)
+{
+	// Reserve a chunk more than needed, and trim it so that the chunks are aligned like huge pages
+	char* reserved = static_cast<char*>(mmap(0, m_size + ChunkSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+	if (reserved == MAP_FAILED)
+		fail("can't reserve the heap's address space", errno);
+	m_base = reinterpret_cast<char*>(DIVU(reinterpret_cast<uintptr_t>(reserved), ChunkSize) * ChunkSize);
+	if (m_base != reserved)
+		munmap(reserved, m_base - reserved);
+	munmap(m_base + m_size, reserved + ChunkSize - m_base);
+}
+
+Region::~Region()
+{
+	munmap(m_base, m_size);
+}
+
+void* Region::allocate(size_t pages)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	size_t first = m_top;
+	std::map<size_t, size_t>::iterator run = m_free.begin();
+	while (run != m_free.end() && run->second < pages)
+		++run;
+	if (run != m_free.end())
+	{
+		first = run->first;
+		if (run->second > pages)
+			m_free[first + pages] = run->second - pages;
+		m_free.erase(run);
+	}
+	else
+	{
+		if ((m_top + pages) * PageSize > m_size)
+			fail("the heap has outgrown its reservation", 0);
+		m_top += pages;
+		if (m_top > m_committed * ChunkPages)
+			commit(DIVU(m_top, ChunkPages) - m_committed);
+	}
+
+	used(first, pages, true);
+	return m_base + first * PageSize;
+}
+
+void Region::release(void* p, size_t pages)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	size_t first = (static_cast<char*>(p) - m_base) / PageSize;
+	used(first, pages, false);
+
+	// Merge the run with the ones on either side of it
+	std::map<size_t, size_t>::iterator next = m_free.lower_bound(first);
+	if (next != m_free.end() && next->first == first + pages)
+	{
+		pages += next->second;
+		m_free.erase(next);
+	}
+	std::map<size_t, size_t>::iterator previous = m_free.lower_bound(first);
+	if (previous != m_free.begin() && (--previous)->first + previous->second == first)
+	{
+		first = previous->first;
+		pages += previous->second;
+		m_free.erase(previous);
+	}
+
+	if (first + pages == m_top)
+		m_top = first;
+	else
+		m_free[first] = pages;
+}
+
+void Region::commit(size_t chunks)
+{
+	char* begin = m_base + m_committed * ChunkSize;
+	size_t size = chunks * ChunkSize;
+
+	bool mapped = false;
+#ifdef MAP_HUGETLB
+	if (m_hugePages == ExplicitHugePages)
+		mapped = mmap(begin, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED;
+#endif
+	if (!mapped && mprotect(begin, size, PROT_READ | PROT_WRITE))
+		fail("can't commit the heap's pages", errno);
+#ifdef MADV_HUGEPAGE
+	// Only advice, which kernels without transparent huge pages turn down
+	if (m_hugePages != NoHugePages && !mapped)
+		madvise(begin, size, MADV_HUGEPAGE);
+#endif
+
+	m_committed += chunks;
+	if (m_hugePages != NoHugePages)
+		m_chunkPages.resize(m_committed);
+}
+
+void Region::fail(const char* what, int error)
+{
+	if (error)
+		fprintf(stderr, "chompact: %s: %s\n", what, strerror(error));
+	else
+		fprintf(stderr, "chompact: %s\n", what);
+	abort();
+}
+
+void Region::used(size_t first, size_t pages, bool allocated)
+{
+	if (m_hugePages == NoHugePages)
+	{
+		if (!allocated)
+			madvise(m_base + first * PageSize, pages * PageSize, MADV_DONTNEED);
+		return;
+	}
+
+	for (size_t chunk = first / ChunkPages; chunk * ChunkPages < first + pages; ++chunk)
+	{
+		size_t begin = std::max(first, chunk * ChunkPages);
+		size_t end = std::min(first + pages, (chunk + 1) * ChunkPages);
+		if (allocated)
+			m_chunkPages[chunk] += end - begin;
+		else if (!(m_chunkPages[chunk] -= end - begin))
+			madvise(m_base + chunk * ChunkSize, ChunkSize, MADV_DONTNEED);
+	}
+}
+
+#ifdef CHOMPACT_COMPRESSED
+//! A reference from one object to another, as stored in a Member.  Compressed, every object lives
+//! in the one region that all heaps share, and a reference is its offset in there.  Objects are
+//! aligned to the smallest size class, so the offset leaves off the low bits and reaches 64GB.
+typedef uint32_t Reference;
+
+const size_t ReferenceShift = 4;
+const size_t CompressedRegionSize = size_t(1) << (32 + ReferenceShift);
+
+//! The start of the region.  Every page starts with its header, so no object is at offset 0, which
+//! stands for a null reference instead.
+char* RegionBase;
+
+//! The region every heap allocates from, reserved by the first heap with its choice of huge pages
+struct CompressedRegion : Region
+{
+	CompressedRegion(HugePages hugePages)
+		: Region(CompressedRegionSize, hugePages)
+	{
+		RegionBase = base();
+	}
+};
+
+inline Region& compressedRegion(HugePages hugePages)
+{
+	static CompressedRegion region(hugePages);
+	return region;
+}
+
+inline Reference compress(const void* p)
+{
+	return p ? Reference((static_cast<const char*>(p) - RegionBase) >> ReferenceShift) : 0;
+}
+
+inline CollectedBase* decompress(Reference r)
+{
+	return r ? reinterpret_cast<CollectedBase*>(RegionBase + (size_t(r) << ReferenceShift)) : 0;
+}
+#else
+typedef CollectedBase* Reference;
+
+inline Reference compress(const void* p)
+{
+	return static_cast<CollectedBase*>(const_cast<void*>(p));
+}
+
+inline CollectedBase* decompress(Reference r)
+{
+	return r;
+}
+#endif
+
+//! Objects are segregated by type onto DataPages whose slots are the smallest size class that
+//! fits the type.  Each size class is the largest multiple of 16 bytes that fits as many slots in
+//! the 4032 byte data area of a page, so the tail a page leaves unused is less than 16 bytes a slot:
+//! none for most classes, and at most 0xc0 bytes, on the pages of 0x100.
+const size_t SizeClasses[] = { 0x10, 0x20, 0x30, 0x40, 0x60, 0x80, 0xc0, 0x100, 0x190, 0x240, 0x3f0, 0x7e0 };
+const size_t NumSizeClasses = sizeof(SizeClasses) / sizeof(SizeClasses[0]);
+
+inline size_t sizeClass(size_t size)
+{
+	size_t c = 0;
+	while (SizeClasses[c] < size)
+		++c;
+	return c;
+}
+
+//! Describes the objects of a single type, and where their references are.  Objects don't carry a
+//! header: every page holds objects of one type only, and records which.
+class TypeDescriptor
+{
+public:
+	//! The id that pages record their type by
+	size_t m_id;
+
+	//! The mangled name of the class, for heap profiles
+	const char* m_name;
+
+	//! The size of the object, and of the slot it is allocated in
+	size_t m_size;
+	size_t m_objectSize;
+
+	//! The offsets of the reference members, relative to the start of the object
+	const uintptr_t* m_children;
+	size_t m_numChildren;
+};
+
+//! Every type that objects are allocated with, indexed by id.  The table is zero initialized before
+//! any constructor runs, so types can register from static initializers.
+const size_t MaxTypes = 1 << 12;
+TypeDescriptor* Types[MaxTypes];
+size_t NumTypes;
+
+inline size_t registerType(TypeDescriptor* type)
+{
+	assert(NumTypes < MaxTypes);
+	Types[NumTypes] = type;
+	return NumTypes++;
+}
+
+//! Every object is allocated at the start of an aligned page or inside of one, and the page begins
+//! with a header saying how the rest of it is laid out.
+class PageHeader
+{
+public:
+	enum Kind { Small, Large };
+
+	//! The epoch of a page while one thread clears its stale marks
+	static const uint32_t Sweeping = ~uint32_t(0);
+
+	PageHeader(Heap* heap, const TypeDescriptor& type, size_t objectSize, uint32_t epoch)
+		: m_heap(heap)
+		, m_type(type.m_id)
+		, m_leaf(!type.m_numChildren)
+		, m_objectSize(objectSize)
+		, m_epoch(epoch)
+	{
+	}
+
+	static PageHeader* pageHeader(const void* _p)
+	{
+		uintptr_t p = reinterpret_cast<uintptr_t>(_p);
+		return reinterpret_cast<PageHeader*>(p & ~(PageSize - 1));
+	}
+
+	Heap* heap() const
+	{
+		return m_heap;
+	}
+
+	Kind kind() const
+	{
+		return m_objectSize ? Small : Large;
+	}
+
+	size_t typeId() const
+	{
+		return m_type;
+	}
+
+	const TypeDescriptor& type() const
+	{
+		return *Types[m_type];
+	}
+
+	//! Whether the objects on the page have no references, so that marking one is all there is to
+	//! it, without ever reading the object
+	bool leaf() const
+	{
+		return m_leaf;
+	}
+
+	uint32_t epoch() const
+	{
+		return m_epoch;
+	}
+
+protected:
+	Heap* m_heap;
+	uint16_t m_type : 15;
+	uint16_t m_leaf : 1;
+
+	//! The size of the slots on a DataPage, and 0 on the pages of a large object.  Only used by
+	//! DataPages, but kept here to pack the header into the padding.
+	uint16_t m_objectSize;
+
+	//! The collection that the marks on the page belong to.  Marks left over from an earlier
+	//! collection are stale, so a page is swept the first time it is touched after a collection
+	//! rather than all at once.
+	uint32_t m_epoch;
+};
+
+//! Finds the children of objects through their pages like CollectedBase::children, but remembers the
+//! last type it looked up.  The objects traced one after another are mostly of the same type, and a
+//! predictable comparison takes the loads through the type table off the critical path of marking.
+class ChildrenLookup
+{
+public:
+	ChildrenLookup()
+		: m_type(~size_t(0))
+	{
+	}
+
+	std::pair<const uintptr_t*, const uintptr_t*> operator()(const void* p)
+	{
+		const PageHeader* page = PageHeader::pageHeader(p);
+		if (page->typeId() != m_type)
+		{
+			const TypeDescriptor& type = page->type();
+			m_type = type.m_id;
+			m_children = std::make_pair(type.m_children, type.m_children + type.m_numChildren);
+		}
+		return m_children;
+	}
+
+private:
+	size_t m_type;
+	std::pair<const uintptr_t*, const uintptr_t*> m_children;
+};
+
+//! All small heap objects are allocated on a DataPage.  DataPages are convenient, because since they are
+//! aligned the static information on the data page can be accessed by any pointer allocated within the
+//! DataPage without any additional space overhead.
 //
-class DataPage
+class DataPage : public PageHeader
 {
 public:
-	static const size_t ObjectSize = 0x10;
+	//! The smallest and largest of the SizeClasses
+	static const size_t MinObjectSize = 0x10;
+	static const size_t MaxObjectSize = 0x7e0;
 
-	//! This is the number of objects that we can keep in a single page, including the bits to mark the
-	//! free spaces.
-	static const size_t Size = ((PageSize - sizeof(Heap*)) * 8) / (ObjectSize * 8 + 1);
+	//! This is the number of objects of the smallest size class that we can keep in a single page,
+	//! including the bits to mark the free spaces.
+	static const size_t MaxSize = ((PageSize - sizeof(PageHeader) - 2 * sizeof(uint32_t) - sizeof(size_t)) * 8) / (MinObjectSize * 8 + 1);
 
 	static const size_t BitsPerWord = sizeof(uintptr_t) * 8;
 
+	static const size_t Words = DIVU(MaxSize, BitsPerWord);
+
+	static const size_t DataSize = MaxSize * MinObjectSize;
+
+private:
+	uint16_t m_size;
+
+public:
+	//! Whether the collection in progress is moving the page's survivors to fresh pages
+	bool m_evacuating;
+
 private:
-	char m_data[Size * ObjectSize];
+	//! The number of marked objects on the page
+	uint32_t m_live;
+
+public:
+	//! During compaction, the number of live objects on all of the pages of the same size class
+	//! preceding this one.
+	size_t m_liveBefore;
 
+private:
 	//! We keep track of the marked bits
-	uintptr_t m_marked[DIVU(Size, BitsPerWord)];
+	uintptr_t m_marked[Words];
 
-	Heap* m_heap;
+	char m_data[DataSize];
 
 public:
-	DataPage(Heap* heap) : m_heap(heap) { }
+	DataPage(Heap* heap, const TypeDescriptor& type, uint32_t epoch)
+		: PageHeader(heap, type, type.m_objectSize, epoch)
+		, m_size(DataSize / type.m_objectSize)
+		, m_evacuating(false)
+	{
+		clear();
+	}
 
-	void* operator new(size_t s)
+	void* operator new(size_t s, Region& region)
 	{
 		assert(s <= PageSize);
-		return mmap(0, PageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return region.allocate(1);
 	}
 
-	static DataPage* dataPage(CollectedBase* _p)
+	void operator delete(void* p, Region& region)
 	{
-		uintptr_t p = reinterpret_cast<uintptr_t>(_p);
-		return reinterpret_cast<DataPage*>(p & ~(PageSize - 1));
+		region.release(p, 1);
 	}
 
-	Heap* heap() const
+	//! Gives the page back to its heap's region
+	void operator delete(void* p);
+
+	static DataPage* dataPage(CollectedBase* p)
 	{
-		return m_heap;
+		assert(pageHeader(p)->kind() == Small);
+		return static_cast<DataPage*>(pageHeader(p));
+	}
+
+	size_t objectSize() const
+	{
+		return m_objectSize;
+	}
+
+	//! The number of objects on the page
+	size_t size() const
+	{
+		return m_size;
 	}
 
 	void* pointer(size_t i)
 	{
-		return static_cast<void*>(&m_data[i * ObjectSize]);
+		return static_cast<void*>(&m_data[i * m_objectSize]);
+	}
+
+	size_t index(const void* p) const
+	{
+		return (static_cast<const char*>(p) - m_data) / m_objectSize;
+	}
+
+	//! Clears the marks if they were left by an earlier collection than epoch
+	void sweep(uint32_t epoch)
+	{
+		if (m_epoch == epoch)
+			return;
+		clear();
+		m_epoch = epoch;
+	}
+
+	//! Sweeps a page that other threads may be marking at the same time.  Whoever swaps the stale
+	//! epoch for Sweeping clears the page, and everyone else waits for it to finish.
+	void sweepAtomic(uint32_t epoch)
+	{
+		uint32_t current = __atomic_load_n(&m_epoch, __ATOMIC_ACQUIRE);
+		if (current == epoch)
+			return;
+
+		if (current != Sweeping && __atomic_compare_exchange_n(&m_epoch, &current, Sweeping, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		{
+			clear();
+			__atomic_store_n(&m_epoch, epoch, __ATOMIC_RELEASE);
+			return;
+		}
+
+		while (__atomic_load_n(&m_epoch, __ATOMIC_ACQUIRE) != epoch)
+			std::this_thread::yield();
+	}
+
+	//! The number of objects that were marked during the collection epoch
+	size_t live(uint32_t epoch) const
+	{
+		return m_epoch == epoch ? m_live : 0;
+	}
+
+	bool full() const
+	{
+		return m_live == m_size;
+	}
+
+	bool mark(size_t i)
+	{
+		uintptr_t bit = uintptr_t(1) << (i % BitsPerWord);
+		if (m_marked[i / BitsPerWord] & bit)
+			return false;
+		m_marked[i / BitsPerWord] |= bit;
+		++m_live;
+		return true;
+	}
+
+	bool markAtomic(size_t i)
+	{
+		uintptr_t bit = uintptr_t(1) << (i % BitsPerWord);
+		if (__atomic_load_n(&m_marked[i / BitsPerWord], __ATOMIC_RELAXED) & bit)
+			return false;
+		if (__atomic_fetch_or(&m_marked[i / BitsPerWord], bit, __ATOMIC_RELAXED) & bit)
+			return false;
+		__atomic_fetch_add(&m_live, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	bool marked(size_t i) const
+	{
+		return m_marked[i / BitsPerWord] & uintptr_t(1) << (i % BitsPerWord);
+	}
+
+	//! Marks every object in [begin, end).  The bits are set atomically, since a concurrent marker
+	//! may be marking the objects on the page that were allocated before it got to them.
+	void markRange(size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; )
+		{
+			size_t bits = std::min(end - i, BitsPerWord - i % BitsPerWord);
+			uintptr_t mask = bits == BitsPerWord ? ~uintptr_t(0) : ((uintptr_t(1) << bits) - 1) << (i % BitsPerWord);
+			uintptr_t old = __atomic_fetch_or(&m_marked[i / BitsPerWord], mask, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&m_live, __builtin_popcountl(mask & ~old), __ATOMIC_RELAXED);
+			i += bits;
+		}
+	}
+
+	//! Unmarks every object in [begin, end), which are all marked
+	void unmarkRange(size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; )
+		{
+			size_t bits = std::min(end - i, BitsPerWord - i % BitsPerWord);
+			uintptr_t mask = bits == BitsPerWord ? ~uintptr_t(0) : ((uintptr_t(1) << bits) - 1) << (i % BitsPerWord);
+			assert((m_marked[i / BitsPerWord] & mask) == mask);
+			m_marked[i / BitsPerWord] &= ~mask;
+			i += bits;
+		}
+		m_live -= end - begin;
+	}
+
+	//! The index of the first unmarked object at or after i, or size() if there is none
+	size_t nextFree(size_t i) const
+	{
+		return next(i, ~uintptr_t(0));
+	}
+
+	//! The index of the first marked object at or after i, or size() if there is none
+	size_t nextMarked(size_t i) const
+	{
+		return next(i, 0);
+	}
+
+	//! The number of marked objects on the page whose index is less than i.
+	size_t countBefore(size_t i) const
+	{
+		size_t count = 0;
+		for (size_t w = 0; w < i / BitsPerWord; ++w)
+			count += __builtin_popcountl(m_marked[w]);
+		if (i % BitsPerWord)
+			count += __builtin_popcountl(m_marked[i / BitsPerWord] & ((uintptr_t(1) << (i % BitsPerWord)) - 1));
+		return count;
+	}
+
+	size_t count() const
+	{
+		return m_live;
+	}
+
+	void clear()
+	{
+		memset(m_marked, '\0', sizeof(m_marked));
+		m_live = 0;
+	}
+
+private:
+	//! Scans the bitmap a word at a time for the first bit at or after i that differs from the
+	//! bits of invert
+	size_t next(size_t i, uintptr_t invert) const
+	{
+		if (i >= m_size)
+			return m_size;
+
+		size_t w = i / BitsPerWord;
+		uintptr_t bits = (m_marked[w] ^ invert) & (~uintptr_t(0) << (i % BitsPerWord));
+		while (!bits)
+		{
+			if (++w == Words)
+				return m_size;
+			bits = m_marked[w] ^ invert;
+		}
+		return std::min<size_t>(w * BitsPerWord + __builtin_ctzl(bits), m_size);
+	}
+};
+
+//! Objects too big for any size class get a run of pages to themselves, which are unmapped as soon as
+//! the object dies and are never moved by compaction.
+class LargeObjectPage : public PageHeader
+{
+public:
+	static const size_t HeaderSize = DIVU(sizeof(PageHeader) + sizeof(size_t), DataPage::MinObjectSize) * DataPage::MinObjectSize;
+
+	//! Large objects are allocated marked
+	LargeObjectPage(Heap* heap, const TypeDescriptor& type, uint32_t epoch)
+		: PageHeader(heap, type, 0, epoch)
+		, m_pages(DIVU(HeaderSize + type.m_size, PageSize))
+	{
+	}
+
+	void* operator new(size_t s, Region& region, size_t objectSize)
+	{
+		assert(s <= HeaderSize);
+		return region.allocate(DIVU(HeaderSize + objectSize, PageSize));
+	}
+
+	void operator delete(void* p, Region& region, size_t objectSize)
+	{
+		region.release(p, DIVU(HeaderSize + objectSize, PageSize));
+	}
+
+	void operator delete(void* p);
+
+	static LargeObjectPage* largeObjectPage(CollectedBase* p)
+	{
+		assert(pageHeader(p)->kind() == Large);
+		return static_cast<LargeObjectPage*>(pageHeader(p));
 	}
 
-	void mark(size_t i)
+	void* pointer()
+	{
+		return reinterpret_cast<char*>(this) + HeaderSize;
+	}
+
+	//! The number of bytes mapped for the object, including the header
+	size_t size() const
+	{
+		return m_pages * PageSize;
+	}
+
+	void mark(uint32_t epoch)
+	{
+		m_epoch = epoch;
+	}
+
+	bool markAtomic(uint32_t epoch)
+	{
+		uint32_t current = __atomic_load_n(&m_epoch, __ATOMIC_RELAXED);
+		return current != epoch && __atomic_compare_exchange_n(&m_epoch, &current, epoch, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+
+	bool marked(uint32_t epoch) const
+	{
+		return m_epoch == epoch;
+	}
+
+private:
+	size_t m_pages;
+};
+
+//! The pages holding the objects of a single type, and where the next allocation in them will start
+//! looking.
+class TypePages
+{
+public:
+	TypePages()
+		: m_nextFreeDataPage(0)
+		, m_nextFreeObject(0)
+		, m_firstNewPage(0)
+	{
+	}
+
+	std::vector<DataPage*> m_pages;
+	size_t m_nextFreeDataPage;
+	size_t m_nextFreeObject;
+
+	//! While the heap is being marked concurrently, objects are only allocated on pages added since
+	//! marking started, which begin at this index.
+	size_t m_firstNewPage;
+};
+
+//! To accomodate more advanced garbage collectors that will move objects, handles
+//! are references to indirect pointers, rather than directly to the objects themselves.
+class IndirectPointerBase
+{
+public:
+	//! Objects are always at least word aligned, so the low bit of a free entry is set to
+	//! distinguish the free list index it holds from an object pointer.
+	static const uintptr_t FreeTag = 1;
+
+	uintptr_t m_data;
+
+	bool valid() const { return !(m_data & FreeTag); }
+	CollectedBase* object() const { return valid() ? reinterpret_cast<CollectedBase*>(m_data) : 0; }
+
+	//! Allocates the indirect pointer for a handle, from the current HandleScope if the handle being
+	//! constructed at owner lives inside of it
+	void* operator new(size_t s, Heap* heap, const void* owner = 0);
+
+	//! Gives the indirect pointer back, unless it belongs to a HandleScope, which frees its own all
+	//! at once
+	void release();
+};
+
+
+//! The IndirectPointerPage is an array of IndirectPointer's that manages the removed
+//! items in a free list.
+class IndirectPointerPage
+{
+public:
+	static const size_t BitsPerWord = sizeof(uintptr_t) * 8;
+
+	//! Six words of header, and then a bit in the bitmap for every entry
+	static const size_t Size = (PageSize / sizeof(uintptr_t) - 6) * BitsPerWord / (BitsPerWord + 1);
+	static const size_t Words = DIVU(Size, BitsPerWord);
+
+	Heap* m_heap;
+	//! The page's index in the heap's list of indirect pointer pages
+	size_t m_index;
+	//! Whether the page belongs to a thread's HandleScopes, which allocate from it in LIFO order
+	//! and never put anything on its free list
+	bool m_scoped;
+	size_t m_begin, m_freeList;
+	//! The number of entries in use, and a bit set for each of them, so that scanning the roots only
+	//! looks at the handles that exist
+	size_t m_count;
+	uintptr_t m_live[Words];
+	IndirectPointerBase m_handles[Size];
+
+	static IndirectPointerPage* indirectPointerPage(const void* p)
+	{
+		return reinterpret_cast<IndirectPointerPage*>(reinterpret_cast<uintptr_t>(p) & ~(PageSize - 1));
+	}
+
+	void* operator new(size_t s, Region& region)
+	{
+		assert(s <= PageSize);
+		return region.allocate(1);
+	}
+
+	void operator delete(void* p, Region& region)
+	{
+		region.release(p, 1);
+	}
+
+	void operator delete(void* p);
+
+	IndirectPointerPage(Heap* heap, size_t index, bool scoped)
+		: m_heap(heap)
+		, m_index(index)
+		, m_scoped(scoped)
+		, m_begin(1)
+		, m_freeList(0)
+		, m_count(0)
+	{
+		memset(m_live, '\0', sizeof(m_live));
+	}
+
+	void* allocateIndirectPointer()
+	{
+		size_t allocated;
+		if (m_freeList)
+		{
+			allocated = m_freeList;
+			assert(!m_handles[allocated].valid());
+
+			m_freeList = m_handles[allocated].m_data >> 1;
+		}
+		else if (m_begin < Size)
+		{
+			allocated = m_begin++;
+		}
+		else
+		{
+			return 0;
+		}
+
+		m_live[allocated / BitsPerWord] |= uintptr_t(1) << (allocated % BitsPerWord);
+		++m_count;
+		return &m_handles[allocated];
+	}
+
+	//! Pushes an indirect pointer onto the free list.  Index 0 is never handed out, so it ends the list.
+	void releaseIndirectPointer(IndirectPointerBase* iptr)
+	{
+		assert(!m_scoped && iptr->valid());
+		size_t i = iptr - m_handles;
+		iptr->m_data = (m_freeList << 1) | IndirectPointerBase::FreeTag;
+		m_freeList = i;
+		m_live[i / BitsPerWord] &= ~(uintptr_t(1) << (i % BitsPerWord));
+		--m_count;
+	}
+
+	//! Frees the entries from begin on of a scoped page, all of which are in use
+	void truncate(size_t begin)
+	{
+		assert(m_scoped);
+		for (size_t i = begin; i < m_begin; ++i)
+			m_live[i / BitsPerWord] &= ~(uintptr_t(1) << (i % BitsPerWord));
+		m_count -= m_begin - begin;
+		m_begin = begin;
+	}
+
+	//! The index of the first entry in use at or after i, or Size if there is none
+	size_t next(size_t i) const
+	{
+		if (i >= Size)
+			return Size;
+
+		size_t w = i / BitsPerWord;
+		uintptr_t bits = m_live[w] & (~uintptr_t(0) << (i % BitsPerWord));
+		while (!bits)
+		{
+			if (++w == Words)
+				return Size;
+			bits = m_live[w];
+		}
+		return w * BitsPerWord + __builtin_ctzl(bits);
+	}
+};
+
+template<typename Class>
+class IndirectPointer : public IndirectPointerBase
+{
+public:
+	IndirectPointer(Collected<Class>* ptr)
+	{
+		m_data = reinterpret_cast<uintptr_t>(ptr);
+	}
+
+	Collected<Class>* collected() const { return static_cast<Collected<Class>*>(object()); }
+	Class* operator->() const { return &collected()->instance; }
+	Class& operator*() const { return collected()->instance; }
+};
+
+//! The knobs controlling how big the heap is allowed to get between collections.  The heap's
+//! capacity is the number of bytes of objects it will hold before collecting again.
+class HeapPolicy
+{
+public:
+	HeapPolicy()
+		: m_initialCapacity(1 << 20)
+		, m_growthFactor(2)
+		, m_targetOccupancy(0.5)
+		, m_decay(4)
+		, m_fragmentation(0.25)
+		, m_markThreads(1)
+		, m_concurrent(false)
+		, m_nurserySize(256 * PageSize)
+		, m_census(false)
+		, m_evacuate(false)
+		, m_conservative(false)
+		, m_reservation(size_t(1) << 36)
+		, m_hugePages(NoHugePages)
+	{
+	}
+
+	//! The capacity the heap starts with, and never shrinks below
+	size_t m_initialCapacity;
+
+	//! How much the capacity is multiplied by when the live objects fill more than the target
+	double m_growthFactor;
+
+	//! The fraction of the capacity that should be live after a collection
+	double m_targetOccupancy;
+
+	//! The number of collections an empty page is kept around for reuse before it is unmapped
+	size_t m_decay;
+
+	//! The fraction of the bytes on the occupied pages that can be free after a collection
+	//! before it compacts the heap, instead of leaving the holes to be filled by allocation
+	double m_fragmentation;
+
+	//! The number of threads that mark in parallel during a collection, including the one that
+	//! started it
+	size_t m_markThreads;
+
+	//! Whether collections started by allocation mark the heap on a background thread, instead of
+	//! stopping the world for the whole collection
+	bool m_concurrent;
+
+	//! The size of the nursery that new objects are allocated in, or 0 to allocate them with the old
+	//! objects.  Most objects die before the nursery fills, and only the survivors are copied out.
+	size_t m_nurserySize;
+
+	//! Whether full collections count the objects they trace by type, for Heap::census
+	bool m_census;
+
+	//! Whether a fragmented heap is defragmented by copying the survivors off its sparsest pages while
+	//! it is marked, rather than by sliding every object down after.  Only serial marking evacuates,
+	//! and parallel marking still slides.
+	bool m_evacuate;
+
+	//! Whether collections also treat every word on the stacks of the threads using the heap, and in
+	//! their registers, that points into one of its objects as a root, so that raw Collected<Class>
+	//! pointers can be kept in local variables without a Handle.  The objects they point to can't
+	//! move, so a conservative heap has no nursery and never slides, and the pages they are on are
+	//! left out of evacuation.
+	bool m_conservative;
+
+	//! The address space reserved for the heap's pages, which it can never grow beyond: a heap that
+	//! needs more aborts.  Compressed heaps all share a single region of 64GB instead.
+	size_t m_reservation;
+
+	//! What backs the heap's pages.  Huge pages take fewer TLB entries and page faults to cover a
+	//! large heap, but free memory is only returned to the system a whole huge page at a time.
+	HugePages m_hugePages;
+};
+
+//! A run of free slots on a DataPage that has been handed to a single thread, which allocates from
+//! it by bumping a pointer.  The slots are marked as soon as the run is claimed, and whatever is left
+//! of the run is given back by the next collection.
+class AllocationBuffer
+{
+public:
+	AllocationBuffer()
+		: m_top(0)
+		, m_end(0)
+	{
+	}
+
+	void* allocate(size_t objectSize)
+	{
+		if (m_top == m_end)
+			return 0;
+
+		void* object = m_top;
+		m_top += objectSize;
+		return object;
+	}
+
+	//! Gives back the slots that haven't been allocated yet
+	void reset()
+	{
+		if (m_top != m_end)
+		{
+			DataPage* page = static_cast<DataPage*>(PageHeader::pageHeader(m_top));
+			page->unmarkRange(page->index(m_top), page->index(m_end));
+		}
+		m_top = m_end = 0;
+	}
+
+	char* m_top;
+	char* m_end;
+};
+
+//! The highest address of the current thread's stack, which grows down from there
+inline char* stackBase()
+{
+	pthread_attr_t attr;
+	void* stack;
+	size_t size;
+	pthread_getattr_np(pthread_self(), &attr);
+	pthread_attr_getstack(&attr, &stack, &size);
+	pthread_attr_destroy(&attr);
+	return static_cast<char*>(stack) + size;
+}
+
+//! The allocation state a thread keeps for each Heap that it allocates from.
+class AllocationContext
+{
+public:
+	//! Whether the thread may be touching the heap's objects, or is stopped at a safepoint, or is
+	//! blocked somewhere a pause doesn't need to wait for it
+	enum State { Running, Stopped, Blocked };
+
+	AllocationContext(Heap* heap)
+		: m_heap(heap)
+		, m_thread(std::this_thread::get_id())
+		, m_state(Running)
+		, m_stackBase(stackBase())
+		, m_stackTop(0)
+		, m_scope(0)
+		, m_scopePage(0)
+	{
+	}
+
+	Heap* m_heap;
+	std::thread::id m_thread;
+
+	//! Changed under the heap's safepoint lock only
+	State m_state;
+
+	//! Where the thread's stack begins, or 0 once the thread has exited, and how far it went and what
+	//! was in the registers when the thread last stopped or blocked.  Only a conservative heap saves
+	//! and scans them.
+	char* m_stackBase;
+	char* m_stackTop;
+	ucontext_t m_registers;
+	//! A buffer for each type, indexed by its id
+	std::vector<AllocationBuffer> m_buffers;
+
+	//! The objects this thread has overwritten references to since the buffer was last handed over
+	//! to the marker
+	std::vector<CollectedBase*> m_overwritten;
+
+	//! The slots outside of the nursery that this thread has stored pointers into it to
+	std::vector<Reference*> m_remembered;
+
+	//! The innermost HandleScope this thread has open on the heap, and the pages its scopes allocate
+	//! indirect pointers from, up to and including the one they are currently allocating from
+	HandleScope* m_scope;
+	std::vector<IndirectPointerPage*> m_scopePages;
+	size_t m_scopePage;
+};
+
+//! The number of heaps being marked concurrently.  The write barrier only needs to do anything while
+//! it's nonzero.
+inline std::atomic<size_t>& concurrentlyMarkedHeaps()
+{
+	static std::atomic<size_t> heaps(0);
+	return heaps;
+}
+
+//! The context of the Heap that the current thread allocated from last.  Heaps are identified by a
+//! serial number instead of their address so that a destroyed Heap is never mistaken for a new one.
+struct CurrentAllocationContext
+{
+	size_t m_heapId;
+	AllocationContext* m_context;
+};
+
+inline CurrentAllocationContext& currentAllocationContext()
+{
+	static thread_local CurrentAllocationContext current = { 0, 0 };
+	return current;
+}
+
+//! The ids of the heaps that haven't been destroyed yet, so that a thread can detach from the heaps
+//! it used when it exits without touching any that are gone.  A heap waits for the threads that are
+//! detaching from it before it goes.
+struct LiveHeaps
+{
+	std::mutex m_lock;
+	std::condition_variable m_detached;
+	std::vector<size_t> m_ids;
+};
+
+inline LiveHeaps& liveHeaps()
+{
+	static LiveHeaps heaps;
+	return heaps;
+}
+
+//! Every context the current thread has attached, which it detaches from their heaps when it exits
+//! so that their pauses don't wait for it forever
+struct AttachedContexts
+{
+	~AttachedContexts();
+
+	std::vector<std::pair<size_t, AllocationContext*> > m_contexts;
+};
+
+inline AttachedContexts& attachedContexts()
+{
+	static thread_local AttachedContexts attached;
+	return attached;
+}
+
+//! The objects waiting to have their children marked by a single marker.  The stack is a list of
+//! fixed size chunks, so pushing never copies what is already on it, and the chunk below the top is
+//! kept when the top one empties so that marking along a chunk boundary doesn't allocate.
+class MarkStack
+{
+public:
+	MarkStack()
+		: m_chunk(new Chunk(0))
+		, m_spare(0)
+		, m_top(0)
+	{
+	}
+
+	~MarkStack()
+	{
+		while (m_chunk)
+		{
+			Chunk* previous = m_chunk->m_previous;
+			delete m_chunk;
+			m_chunk = previous;
+		}
+		delete m_spare;
+	}
+
+	void push(CollectedBase* p)
+	{
+		if (m_top == ChunkSize)
+		{
+			Chunk* chunk = m_spare ? m_spare : new Chunk(m_chunk);
+			chunk->m_previous = m_chunk;
+			m_chunk = chunk;
+			m_spare = 0;
+			m_top = 0;
+		}
+		m_chunk->m_objects[m_top++] = p;
+	}
+
+	CollectedBase* pop()
+	{
+		assert(!empty());
+		if (!m_top)
+		{
+			delete m_spare;
+			m_spare = m_chunk;
+			m_chunk = m_chunk->m_previous;
+			m_top = ChunkSize;
+		}
+		return m_chunk->m_objects[--m_top];
+	}
+
+	bool empty() const { return !m_top && !m_chunk->m_previous; }
+
+private:
+	//! Fills a page
+	static const size_t ChunkSize = PageSize / sizeof(CollectedBase*) - 1;
+
+	struct Chunk
+	{
+		Chunk(Chunk* previous) : m_previous(previous) {}
+
+		Chunk* m_previous;
+		CollectedBase* m_objects[ChunkSize];
+	};
+
+	Chunk* m_chunk;
+	Chunk* m_spare;
+	size_t m_top;
+};
+
+//! A short FIFO between the mark stack and the object scanner.  Objects are prefetched as they go
+//! in and scanned as they come out a few objects later, by which time their fields are on their way
+//! into the cache, rather than stalling on each one as it is popped (Cher, Hosking and Vijaykumar,
+//! "Software Prefetching for Mark-Sweep Garbage Collection").
+class PrefetchQueue
+{
+public:
+	PrefetchQueue()
+		: m_head(0)
+		, m_size(0)
+	{
+	}
+
+	bool full() const { return m_size == Distance; }
+	bool empty() const { return !m_size; }
+
+	void push(CollectedBase* p)
+	{
+		assert(!full());
+		__builtin_prefetch(p);
+		m_objects[(m_head + m_size++) & (Distance - 1)] = p;
+	}
+
+	CollectedBase* pop()
+	{
+		assert(!empty());
+		CollectedBase* p = m_objects[m_head];
+		m_head = (m_head + 1) & (Distance - 1);
+		--m_size;
+		return p;
+	}
+
+private:
+	//! Roughly how many objects can be scanned in the time it takes to fetch one from memory
+	static const size_t Distance = 8;
+
+	CollectedBase* m_objects[Distance];
+	size_t m_head;
+	size_t m_size;
+};
+
+//! A Chase-Lev work stealing deque of objects waiting to have their children marked.  The owner
+//! pushes and takes from the bottom without contention, while idle markers steal from the top.
+//! The deque grows by moving to a chunk twice the size; the old chunks are kept until reset,
+//! since a thief may still be reading one.
+class MarkDeque
+{
+public:
+	MarkDeque()
+		: m_top(0)
+		, m_bottom(0)
+		, m_chunk(new Chunk(1024))
+	{
+		m_chunks.push_back(m_chunk.load());
+	}
+
+	~MarkDeque()
+	{
+		for (size_t i = 0; i < m_chunks.size(); ++i)
+			delete m_chunks[i];
+	}
+
+	void push(CollectedBase* p)
+	{
+		int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+		int64_t top = m_top.load(std::memory_order_acquire);
+		Chunk* chunk = m_chunk.load(std::memory_order_relaxed);
+		if (bottom - top >= static_cast<int64_t>(chunk->m_size))
+			chunk = grow(chunk, top, bottom);
+		chunk->put(bottom, p);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_bottom.store(bottom + 1, std::memory_order_relaxed);
+	}
+
+	CollectedBase* take()
+	{
+		int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+		Chunk* chunk = m_chunk.load(std::memory_order_relaxed);
+		m_bottom.store(bottom, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t top = m_top.load(std::memory_order_relaxed);
+
+		CollectedBase* p = 0;
+		if (top <= bottom)
+		{
+			p = chunk->get(bottom);
+			if (top == bottom)
+			{
+				// The last object, which a thief may be after as well
+				if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					p = 0;
+				m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			}
+		}
+		else
+		{
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+		}
+		return p;
+	}
+
+	//! Returns 0 if the deque is empty, or if another thread got to the top object first
+	CollectedBase* steal()
+	{
+		int64_t top = m_top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t bottom = m_bottom.load(std::memory_order_acquire);
+		if (top >= bottom)
+			return 0;
+
+		CollectedBase* p = m_chunk.load(std::memory_order_acquire)->get(top);
+		if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return 0;
+		return p;
+	}
+
+	bool empty() const
+	{
+		return m_top.load(std::memory_order_acquire) >= m_bottom.load(std::memory_order_acquire);
+	}
+
+	//! Frees all but the current chunk.  Only called while no one else is using the deque.
+	void reset()
+	{
+		assert(empty());
+		for (size_t i = 0; i + 1 < m_chunks.size(); ++i)
+			delete m_chunks[i];
+		m_chunks.erase(m_chunks.begin(), m_chunks.end() - 1);
+	}
+
+private:
+	struct Chunk
+	{
+		Chunk(size_t size)
+			: m_size(size)
+			, m_objects(new std::atomic<CollectedBase*>[size])
+		{
+		}
+
+		~Chunk()
+		{
+			delete[] m_objects;
+		}
+
+		CollectedBase* get(int64_t i) const { return m_objects[i & (m_size - 1)].load(std::memory_order_relaxed); }
+		void put(int64_t i, CollectedBase* p) { m_objects[i & (m_size - 1)].store(p, std::memory_order_relaxed); }
+
+		size_t m_size;
+		std::atomic<CollectedBase*>* m_objects;
+	};
+
+	Chunk* grow(Chunk* chunk, int64_t top, int64_t bottom)
+	{
+		Chunk* grown = new Chunk(chunk->m_size * 2);
+		for (int64_t i = top; i < bottom; ++i)
+			grown->put(i, chunk->get(i));
+		m_chunks.push_back(grown);
+		m_chunk.store(grown, std::memory_order_release);
+		return grown;
+	}
+
+	std::atomic<int64_t> m_top;
+	std::atomic<int64_t> m_bottom;
+	std::atomic<Chunk*> m_chunk;
+	std::vector<Chunk*> m_chunks;
+};
+
+//! The threads that mark the heap in parallel.  Each one scans its share of the roots into its own
+//! MarkDeque, and steals from the others' once it runs out.
+class ParallelMarker
+{
+public:
+	ParallelMarker(Heap* heap, size_t threads);
+	~ParallelMarker();
+
+	//! Marks everything reachable from the roots, using the calling thread as one of the markers
+	void mark();
+
+private:
+	void run(size_t worker);
+	void work(size_t worker);
+	void trace(CollectedBase* p, MarkDeque& deque, ChildrenLookup& lookup, size_t* census);
+
+	//! Pushes an object that was just marked to be traced, or only counts it if it is a leaf
+	void grey(CollectedBase* p, MarkDeque& deque, size_t* census);
+	CollectedBase* steal(size_t worker, uint32_t& random);
+	bool terminate();
+
+	Heap* m_heap;
+	size_t m_threads;
+	std::vector<MarkDeque*> m_deques;
+	std::vector<std::thread> m_workers;
+
+	std::mutex m_mutex;
+	std::condition_variable m_start;
+	std::condition_variable m_finish;
+	size_t m_generation;
+	size_t m_finished;
+	bool m_stop;
+
+	//! The number of markers that have run out of work
+	std::atomic<size_t> m_idle;
+};
+
+//! The thread that marks the heap between the pause that starts a concurrent collection and the one
+//! that finishes it.  It parks once it runs out of work, and the next allocation that finds it parked
+//! finishes the collection.
+class ConcurrentMarker
+{
+public:
+	ConcurrentMarker(Heap* heap);
+	~ConcurrentMarker();
+
+	void start();
+
+	//! Returns once the marker has parked, asking it to stop early if it hasn't yet
+	void stop();
+
+	bool parked();
+
+private:
+	void run();
+
+	Heap* m_heap;
+	std::thread m_thread;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_park;
+	bool m_marking;
+	bool m_exit;
+	std::atomic<bool> m_stop;
+};
+
+inline size_t nextHeapId()
+{
+	static std::atomic<size_t> id(1);
+	return id++;
+}
+
+//! A stop of the mutators, as reported to a Heap's observer
+struct Pause
+{
+	enum Kind
+	{
+		//! A collection of the nursery
+		Minor,
+		//! A stop-the-world collection, or the end of a concurrent one
+		Full,
+		//! The start of a concurrent collection, or a slice of an incremental one
+		Slice
+	};
+
+	Pause()
+		: m_kind(Full)
+		, m_seconds(0)
+		, m_roots(0)
+		, m_mark(0)
+		, m_sweep(0)
+		, m_objectsMarked(0)
+		, m_bytesMarked(0)
+	{
+	}
+
+	Kind m_kind;
+	double m_seconds;
+
+	//! The seconds spent scanning the roots, tracing from them, and sweeping or compacting.  The
+	//! parallel marker scans the roots as it traces, so its time is all marking.
+	double m_roots;
+	double m_mark;
+	double m_sweep;
+
+	//! The objects a full collection found live, or those a minor collection promoted
+	size_t m_objectsMarked;
+	size_t m_bytesMarked;
+};
+
+//! A snapshot of a Heap's counters and of the state of its pages, as returned by Heap::stats.  The
+//! counters are only updated by pauses and by the slow path of allocation, which hands out memory a
+//! buffer at a time, so keeping them costs the mutators nothing.
+struct HeapStats
+{
+	//! Pauses are counted by length in buckets of powers of two: bucket i holds the pauses of at
+	//! least 2^(i-1) and less than 2^i microseconds, and the last one holds everything longer.
+	static const size_t PauseBuckets = 24;
+
+	HeapStats()
+	{
+		memset(this, '\0', sizeof(*this));
+	}
+
+	size_t m_collections;
+	size_t m_minorCollections;
+
+	size_t m_pauses;
+	size_t m_pauseHistogram[PauseBuckets];
+	double m_pauseSeconds;
+	double m_maxPause;
+
+	//! The seconds spent in each phase of the pauses, as in Pause
+	double m_rootSeconds;
+	double m_markSeconds;
+	double m_sweepSeconds;
+
+	//! The bytes handed out to the mutators in all, and since the last collection of either kind
+	size_t m_bytesAllocated;
+	size_t m_bytesAllocatedSinceCollection;
+
+	//! What the last full collection found live, and the capacity it left the heap with
+	size_t m_liveObjects;
+	size_t m_liveBytes;
+	size_t m_capacity;
+
+	size_t m_dataPages;
+	size_t m_freeDataPages;
+	size_t m_nurseryPages;
+	size_t m_largeObjects;
+	size_t m_indirectPointerPages;
+	size_t m_handles;
+
+	//! The fraction of the slots on the occupied data pages that are free
+	double m_fragmentation;
+};
+
+//! The live objects of one type, as counted by a full collection
+struct CensusEntry
+{
+	const TypeDescriptor* m_type;
+	size_t m_objects;
+	size_t m_bytes;
+};
+
+inline bool largerCensusEntry(const CensusEntry& a, const CensusEntry& b)
+{
+	return a.m_bytes > b.m_bytes;
+}
+
+//! The records of an object graph written by Heap::dumpGraph, which graph2dot turns into a DOT file.
+//! The stream starts with GraphMagic, followed by a Type record for every registered type and then a
+//! Root or Object record for everything the collection traced, in the order it traced them.  Every
+//! record starts with its one byte tag, and every field is written in the byte order of the machine.
+const char GraphMagic[8] = { 'c', 'h', 'o', 'm', 'p', 'g', 'r', '1' };
+
+struct GraphRecord
+{
+	enum Tag
+	{
+		//! uint32 id, uint64 size, uint32 length, then the length bytes of the mangled class name
+		Type = 'T',
+		//! uint64 address of an object referenced by a handle
+		Root = 'R',
+		//! uint64 address, uint32 type id, uint32 count, then the uint64 addresses of the count
+		//! objects it references
+		Object = 'O'
+	};
+};
+
+class Heap
+{
+	friend class ParallelMarker;
+	friend class ConcurrentMarker;
+
+public:
+	Heap(const HeapPolicy& policy = HeapPolicy());
+	~Heap();
+
+	bool marked(CollectedBase*);
+	void mark(CollectedBase*);
+
+	//! Marks an object that other threads may be marking at the same time, returning whether it
+	//! was this call that marked it
+	bool markAtomic(CollectedBase*);
+
+	static Heap* heap(CollectedBase*);
+
+	//! The region the heap's pages are allocated from
+	Region& region()
+	{
+		return *m_region;
+	}
+
+	//! Collects garbage, stopping the world for the whole collection.  If a concurrent collection is
+	//! in progress, it is finished instead.
+	void collect();
+	void markChildren(CollectedBase* p);
+
+	//! Takes the short pause that starts marking concurrently with the mutators
+	void startConcurrentCollection();
+
+	//! Does a slice of a collection on the calling thread, in between which the mutators run.  The
+	//! first call starts marking, every call scans handles and traces objects for at most budget of
+	//! them in total, and the call that runs out of things to mark finishes the collection and
+	//! returns true.
+	bool collectIncremental(size_t budget);
+
+	//! The write barrier, which records the object a reference pointed to before it was overwritten
+	//! while the heap is being marked concurrently.  Everything that was reachable when marking began
+	//! is then marked, even if the mutators move it around in the meantime.
+	static void overwritten(void* p)
+	{
+		if (!concurrentlyMarkedHeaps().load(std::memory_order_relaxed) || !p)
+			return;
+
+		CollectedBase* object = static_cast<CollectedBase*>(p);
+		Heap* heap = Heap::heap(object);
+		if (heap->m_concurrentlyMarking.load(std::memory_order_relaxed) && !heap->young(object))
+			heap->logOverwritten(object);
+	}
+
+	//! The generational write barrier, which remembers the slots outside of the nursery that are made
+	//! to point into it, so that a minor collection finds the objects referenced from them without
+	//! tracing the old objects.
+	static void written(Reference* slot, void* p)
+	{
+		if (!p)
+			return;
+
+		Heap* heap = Heap::heap(static_cast<CollectedBase*>(p));
+		if (heap->young(p) && !heap->young(slot))
+			heap->context()->m_remembered.push_back(slot);
+	}
+
+	//! Whether p was allocated in the nursery, and hasn't survived a collection yet
+	bool young(const void* p) const
+	{
+		return p >= m_nurseryBegin && p < m_nurseryEnd;
+	}
+
+	//! Copies the objects that survive in the nursery out to the old objects, tracing from the roots
+	//! and the remembered slots only
+	void collectNursery();
+
+	//! Stops the calling thread while another one takes a pause.  Every pause waits for all of the
+	//! threads using the heap to stop, so a thread that goes a long time without allocating has to
+	//! poll this now and again.  Like allocation, it may move objects, so only handles stay valid
+	//! across it.
+	void safepoint()
+	{
+		if (m_stopping.load(std::memory_order_relaxed))
+			stop();
+	}
+
+	//! Stops using the heap from the calling thread, so that pauses no longer wait for it.  Threads
+	//! detach from every heap when they exit, and attach again the next time they use it.
+	void detach();
+
+	//! Has observer(pause, data) called at the end of every pause, on the thread that took it.  A
+	//! collection that another one starts with, like the nursery collection before a full one, is
+	//! counted as part of it.
+	void observe(void (*observer)(const Pause&, void*), void* data);
+
+	HeapStats stats();
+
+	const HeapPolicy& policy() const
+	{
+		return m_policy;
+	}
+
+	//! The live objects of every type, largest first, as counted by the last full collection to
+	//! finish since HeapPolicy::m_census was set.  Objects allocated while a collection marks
+	//! concurrently are live without being traced, so it doesn't count them.
+	std::vector<CensusEntry> census();
+
+	//! Collects garbage, writing the object graph it traces to file as described by GraphRecord.  The
+	//! collection marks on the calling thread only, whatever the policy.
+	void dumpGraph(FILE* file);
+
+	//! The slow path of allocation, taken when the thread's AllocationBuffer is empty
+	void* allocateObject(const TypeDescriptor& type);
+	void* allocateIndirectPointer(const void* owner);
+	void releaseIndirectPointer(IndirectPointerBase* iptr);
+
+	//! Adds a weak handle to the table that collections clear dead objects from, or takes it out
+	void registerWeakHandle(WeakHandleBase* weak);
+	void unregisterWeakHandle(WeakHandleBase* weak);
+
+	AllocationContext* context()
+	{
+		CurrentAllocationContext& current = currentAllocationContext();
+		if (current.m_heapId == m_id)
+			return current.m_context;
+		return attach();
+	}
+
+private:
+	friend class SafeRegion;
+	friend struct AttachedContexts;
+
+	AllocationContext* attach();
+
+	//! Moves the thread in and out of the Blocked state.  A thread leaving it waits out any pause in
+	//! progress first.
+	void block(AllocationContext* context);
+	void unblock(AllocationContext* context);
+
+	//! Blocks the context of a thread that is exiting.  Its stack is about to go away, so it waits
+	//! for any pause that may be scanning it, and the pauses after leave it alone.
+	void exited(AllocationContext* context);
+
+	//! Hands what the blocked context of an exited thread still holds over to the heap, and deletes it
+	void removeContext(AllocationContext* context);
+
+	//! Records the calling thread's registers and the top of its stack in its context
+	void saveStack(AllocationContext* context) __attribute__((noinline));
+
+	//! Parks the thread at a safepoint until the pause is over
+	void stop();
+
+	//! Waits for every other thread using the heap to stop or block, and lets them go again
+	void stopMutators();
+	void resumeMutators();
+
+	//! Holds m_lock for a mutator.  A pause holds the lock throughout and waits for every mutator to
+	//! stop, so a mutator that has to wait for the lock blocks while it does.
+	class MutatorLock
+	{
+	public:
+		MutatorLock(Heap* heap);
+		~MutatorLock() { m_heap->m_lock.unlock(); }
+
+	private:
+		Heap* m_heap;
+	};
+
+	void markFromRoots();
+
+	//! Finds the objects that the words on the threads' stacks and in their registers point into,
+	//! and keeps their pages from being evacuated.  It goes by the marks left by the last collection
+	//! and the allocations since, so that a word that happens to point at a free slot is ignored.
+	void scanStacks() __attribute__((noinline));
+
+	//! Reads whole stacks, redzones and all, including the frames a blocked thread may be
+	//! overwriting with garbage below the ones it left the heap from
+	void scanWords(const void* begin, const void* end, const std::vector<PageHeader*>& pages) __attribute__((no_sanitize_address, no_sanitize_thread));
+
+	//! Marks the objects scanStacks found, for the epoch that has started since
+	void markStackRoots();
+
+	void logOverwritten(CollectedBase* p);
+	void flushOverwritten(AllocationContext* context);
+
+	//! Takes the pause that every marking cycle starts with
+	void beginMarking();
+
+	//! Scans the handles that haven't been scanned yet this cycle, taking one unit of the budget for
+	//! each, and returns true once there are none left
+	bool markRoots(size_t& budget);
+
+	//! Marks from the grey objects and the overwritten references, taking one unit of the budget for
+	//! each object traced, and returns true if there is nothing left to mark
+	bool markSome(size_t& budget);
+	void traceConcurrently(CollectedBase* p);
+
+	//! Takes the pause that finishes a concurrent collection
+	void finishConcurrentCollection();
+
+	//! Resets every thread's AllocationBuffers, and the ones objects are promoted into
+	void resetAllocationBuffers();
+
+	//! Hands a fresh page of the nursery to the buffer
+	bool claimNurseryPage(const TypeDescriptor& type, AllocationBuffer& buffer);
+
+	//! Copies a young object out of the nursery, unless it already has been, and returns its new address
+	CollectedBase* promote(CollectedBase* p, std::vector<CollectedBase*>& promoted);
+
+	//! Flags the pages that are no more than half full for evacuation by the coming marking
+	void chooseEvacuationCandidates();
+
+	//! Whether the object is on a page being evacuated
+	bool evacuating(CollectedBase* p);
+
+	//! Copies an object off a page being evacuated and queues the copy for marking, unless it already
+	//! has been, and returns its new address
+	CollectedBase* evacuate(CollectedBase* p);
+
+	//! Frees the pages that have been evacuated, and the copies' unused slots
+	void releaseEvacuatedPages();
+
+	//! Called when an allocation finds the heap at capacity.  Returns true if memory was reclaimed,
+	//! and false if the heap should grow instead.
+	bool collectAtCapacity();
+
+	//! The number of overwritten references a thread buffers before handing them over to the marker
+	static const size_t OverwrittenBufferSize = 512;
+
+	//! Hands the next run of free slots in the size class to the buffer
+	bool claimFreeRun(TypePages& typePages, AllocationBuffer& buffer);
+	void* allocateLargeObject(const TypeDescriptor& type);
+	void sweepLargeObjects();
+
+	DataPage* allocateDataPage(const TypeDescriptor& type);
+
+	//! Makes room for the pages of the types registered since the heap last looked
+	void addTypes();
+	void releaseDataPage(DataPage* page);
+
+	//! Whether enough of the occupied pages is free that it is worth compacting them
+	bool fragmented();
+	double fragmentation();
+
+	//! Frees the pages that nothing was marked on, and leaves the rest to be swept by allocation
+	void releaseEmptyPages();
+
+	//! Unmaps the indirect pointer pages whose handles have all been destroyed.  The pages of
+	//! HandleScopes stay with their threads.
+	void releaseEmptyIndirectPointerPages();
+
+	//! Picks the capacity for the next cycle and unmaps the pages that have been empty for too long
+	void resize();
+
+	//! Slides every marked object down to the front of its size class, Lisp2 style, rewriting all of
+	//! the references to them and releasing the pages that are left empty.
+	void compact();
+	size_t number(TypePages& typePages);
+	void slide(TypePages& typePages, size_t live);
+	CollectedBase* forward(CollectedBase* p) const;
+	void forwardChildren(CollectedBase* p);
+
+	MarkStack m_marking;
+	ParallelMarker* m_marker;
+
+	//! Used by whichever thread is marking from m_marking
+	ChildrenLookup m_children;
+
+	//! The objects found by scanStacks
+	std::vector<CollectedBase*> m_stackRoots;
+
+	//! Whether the marking in progress copies the objects on the pages flagged m_evacuating, which
+	//! it copies into m_promotionBuffers
+	bool m_evacuating;
+
+	ConcurrentMarker* m_concurrentMarker;
+	std::atomic<bool> m_concurrentlyMarking;
+
+	//! Whether the marking in progress is done by collectIncremental rather than the marker thread
+	bool m_markingIncrementally;
+
+	//! The next handle to scan during incremental marking
+	size_t m_rootPage;
+	size_t m_rootIndex;
+
+	//! The overwritten references that threads have handed over to the marker
+	std::mutex m_overwrittenLock;
+	std::vector<CollectedBase*> m_overwritten;
+
+	size_t m_id;
+	//! The number of exiting threads that are detaching from the heap, under the LiveHeaps lock
+	size_t m_detaching;
+
+	//! The collection that the marks on the pages are for
+	uint32_t m_epoch;
+
+	Region* m_region;
+
+	//! Guards everything but the AllocationBuffers, which belong to their threads
+	std::recursive_mutex m_lock;
+	std::vector<AllocationContext*> m_contexts;
+
+	//! Set while a thread stops the others for a pause.  Threads change the state of their contexts,
+	//! and wait for each other to, under m_safepointLock.
+	std::atomic<bool> m_stopping;
+	std::mutex m_safepointLock;
+	std::condition_variable m_safepointChanged;
+
+	//! Guards the indirect pointer pages and the weak handles against the other mutators.  It is
+	//! never held at a safepoint, so a pause has them to itself without taking it.
+	std::mutex m_handleLock;
+
+	HeapPolicy m_policy;
+	size_t m_capacity;
+	size_t m_collections;
+
+	//! The bytes of objects that survived the last collection, and that were allocated since
+	size_t m_liveBytes;
+	size_t m_bytesAllocated;
+
+	//! The pages of each type, indexed by its id
+	std::vector<TypePages> m_dataPages;
+
+	//! Empty pages waiting to be reused, along with the collection that emptied them
+	std::vector<std::pair<DataPage*, size_t> > m_freeDataPages;
+
+	std::vector<LargeObjectPage*> m_largeObjects;
+	size_t m_largeObjectBytes;
+
+	std::vector<IndirectPointerPage*> m_indirectPointerPages;
+	size_t m_nextFreeIndirectPointerPage;
+
+	//! The nursery is a single mapping, so the write barrier can tell young objects apart by their
+	//! address.  Its pages are handed out in order and all taken back by a minor collection.
+	char* m_nurseryBegin;
+	char* m_nurseryTop;
+	char* m_nurseryEnd;
+	size_t m_minorCollections;
+
+	//! The remembered slots of the threads that have exited
+	std::vector<Reference*> m_remembered;
+
+	//! The buffers objects are promoted into by minor collections, and evacuated into by full ones
+	std::vector<AllocationBuffer> m_promotionBuffers;
+
+	//! Times a pause for the observer from construction to destruction, unless it's part of another
+	class PauseTimer
+	{
+	public:
+		PauseTimer(Heap* heap, Pause::Kind kind);
+		~PauseTimer();
+
+	private:
+		Heap* m_heap;
+		Pause::Kind m_kind;
+		std::chrono::steady_clock::time_point m_start;
+	};
+
+	//! Adds the time since the last lap to a phase of the pause being timed, and starts the next lap
+	void lap(double& phase);
+
+	//! Starts and finishes recording the objects traced by a full collection, if it should
+	void beginCensus();
+	void endCensus();
+
+	//! Queues an object that was just marked to be traced, unless it is a leaf, which is done with
+	void grey(CollectedBase* p)
+	{
+		if (PageHeader::pageHeader(p)->leaf())
+			record(p);
+		else
+			m_marking.push(p);
+	}
+
+	//! Counts an object as it is traced, and writes it out if the graph is being dumped
+	void record(CollectedBase* p)
+	{
+		if (m_recording)
+			recordObject(p);
+	}
+	void recordObject(CollectedBase* p);
+	void recordRoot(CollectedBase* p);
+
+	//! Clears the weak handles to the objects that a collection found dead, in one pass over the
+	//! table, and drops them from it.  After a minor collection the handles to promoted objects are
+	//! pointed at their copies.
+	void sweepWeakHandles(bool minor);
+
+	//! Allocates from a buffer that has just been refilled, counting the refill as allocated
+	void* allocateRefilled(AllocationBuffer& buffer, const TypeDescriptor& type);
+
+	void (*m_observer)(const Pause&, void*);
+	void* m_observerData;
+	size_t m_pauses;
+
+	//! The outermost pause being timed, and when its current phase began
+	Pause m_pause;
+	std::chrono::steady_clock::time_point m_lap;
+
+	//! The counters that stats() doesn't compute from the heap itself
+	HeapStats m_stats;
+	size_t m_bytesAllocatedAtCollection;
+
+	//! The objects traced so far by type while a collection records them, and those counted by the
+	//! last one to finish
+	bool m_recording;
+	std::vector<size_t> m_tally;
+	std::vector<size_t> m_census;
+	FILE* m_graph;
+
+	//! Every weak handle to an object on the heap, each knowing its index, and the callbacks of
+	//! those cleared by the current pause, which run once it's over
+	std::vector<WeakHandleBase*> m_weakHandles;
+	std::vector<std::pair<void (*)(void*), void*> > m_clearedWeakHandles;
+};
+
+//! The reference members of a class, declared at compile time with CHOMPACT_TRACE.  Classes that
+//! don't declare them have their members discovered by ObjectInfo instead, by constructing a
+//! prototype and recording where the MemberBase constructors ran.
+template<typename Class>
+struct TraceTable
+{
+	static const bool Declared = false;
+	static constexpr const uintptr_t* Offsets = 0;
+	static const size_t Size = 0;
+};
+
+//! Declares the reference members of a class, so that its offsets are a constant table rather than
+//! something found at startup.  It goes at namespace scope after the class, listing up to 16 members:
+//!
+//!     CHOMPACT_TRACE(List, next)
+//!
+//! A class without reference members is declared with an empty list, CHOMPACT_TRACE(Doubles).  The
+//! offsets are taken with offsetof, so the class should be standard layout.  A Collected<Class>
+//! starts with its instance, so they are the offsets within the Collected object as well.  Debug
+//! builds check the list against the members discovered on a prototype.
+#define CHOMPACT_TRACE(Class, ...) \
+	template<> \
+	struct TraceTable<Class> \
+	{ \
+		static const bool Declared = true; \
+		static constexpr uintptr_t Offsets[] = { CHOMPACT_FOR_EACH(CHOMPACT_OFFSET, Class, ##__VA_ARGS__) 0 }; \
+		static const size_t Size = CHOMPACT_COUNT(Class, ##__VA_ARGS__); \
+	}; \
+	constexpr uintptr_t TraceTable<Class>::Offsets[];
+
+// The table ends with an unused zero, so that it isn't empty when the class has no members.  The
+// counting takes a leading argument so that the comma before an empty list can be pasted away.
+#define CHOMPACT_OFFSET(Class, member) offsetof(Class, member),
+#define CHOMPACT_CAT(a, b) CHOMPACT_CAT_(a, b)
+#define CHOMPACT_CAT_(a, b) a##b
+#define CHOMPACT_COUNT(C, ...) CHOMPACT_COUNT_(C, ##__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define CHOMPACT_COUNT_(C, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define CHOMPACT_FOR_EACH(M, C, ...) CHOMPACT_CAT(CHOMPACT_FOR_EACH_, CHOMPACT_COUNT(C, ##__VA_ARGS__))(M, C, ##__VA_ARGS__)
+#define CHOMPACT_FOR_EACH_0(M, C, ...)
+#define CHOMPACT_FOR_EACH_1(M, C, a) M(C, a)
+#define CHOMPACT_FOR_EACH_2(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_1(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_3(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_2(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_4(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_3(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_5(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_4(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_6(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_5(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_7(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_6(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_8(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_7(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_9(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_8(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_10(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_9(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_11(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_10(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_12(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_11(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_13(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_12(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_14(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_13(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_15(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_14(M, C, __VA_ARGS__)
+#define CHOMPACT_FOR_EACH_16(M, C, a, ...) M(C, a) CHOMPACT_FOR_EACH_15(M, C, __VA_ARGS__)
+
+//! Member<> is a wrapper around the data members of a class used to automatically
+//! generate the list of objects that need to be marked for each type.
+template<typename Class>
+class MemberBase
+{
+public:
+	MemberBase();
+
+	//! Every store to a member goes through the write barrier.  The store releases the object, so a
+	//! concurrent marker that finds it also sees the page it was allocated on.
+	void write(void* p)
+	{
+		Heap::overwritten(decompress(m_reference));
+		Heap::written(&m_reference, p);
+		__atomic_store_n(&m_reference, compress(p), __ATOMIC_RELEASE);
+	}
+
+	Reference m_reference;
+};
+
+template<typename Class>
+class ObjectInfo : public TypeDescriptor
+{
+	friend class Collected<Class>;
+
+public:
+	ObjectInfo();
+	void append(MemberBase<Class>*);
+
+	//! The ObjectInfo whose prototype is being constructed, which its members append themselves to.
+	//! They can't go through Collected<Class>::info, since the value of an object under construction
+	//! is unspecified when accessed other than through its constructor's this pointer.
+	static ObjectInfo* discovering;
+
+private:
+	void discover();
+
+	//! The offsets discovered from the prototype, for classes without a TraceTable
+	std::vector<uintptr_t> m_offsets;
+};
+
+class CollectedBase
+{
+public:
+	//! The offsets of the reference members, relative to the start of the object.  They are found
+	//! through the page rather than a vtable, which saves every object a word.
+	std::pair<const uintptr_t*, const uintptr_t*> children() const
+	{
+		const TypeDescriptor& type = PageHeader::pageHeader(this)->type();
+		return std::make_pair(type.m_children, type.m_children + type.m_numChildren);
+	}
+
+	Reference* child(const uintptr_t* offset)
+	{
+		return reinterpret_cast<Reference*>(reinterpret_cast<char*>(this) + *offset);
+	}
+};
+
+template<typename Class>
+class Collected : public CollectedBase
+{
+public:
+	Collected()
+	{
+		// ASSERT that this pointer has been
+		// heap allocated
+	}
+
+	void* operator new(size_t size, Heap&);
+
+	Class instance;
+	static ObjectInfo<Class> info;
+};
+
+//! Member is a wrapper around a pointer member of a c++ class.  The first template parameter
+//! is the type of the class that the member belongs to, while the second template parameter
+//! the type of the pointer member.  For example, in a class Dictionary, a pointer member to
+//! a type String would be Member<Dictionary, String>
+template<typename Class, typename Property>
+class Member : public MemberBase<Class>
+{
+public:
+	Member() {}
+	Member(Collected<Property>*);
+
+	Collected<Property>* collected() const { return static_cast<Collected<Property>*>(decompress(MemberBase<Class>::m_reference)); }
+	Property& operator*() const { return collected()->instance; }
+	Property* operator->() const { return &collected()->instance; }
+	operator bool() const { return MemberBase<Class>::m_reference != 0; }
+
+	Member& operator=(Collected<Property>* collected)
+	{
+		MemberBase<Class>::write(collected);
+		return *this;
+	}
+
+	Member& operator=(const Member& member)
+	{
+		MemberBase<Class>::write(member.collected());
+		return *this;
+	}
+
+	template<typename T>
+	Member& operator=(const Member<T, Property>& handle)
+	{
+		MemberBase<Class>::write(handle.collected());
+		return *this;
+	}
+
+	Member& operator=(const Handle<Property>& handle)
+	{
+		MemberBase<Class>::write(handle.collected());
+		return *this;
+	}
+};
+
+template<typename Class>
+class Handle
+{
+public:
+	Handle() : m_iptr(0) {}
+	Handle(Collected<Class>* ptr);
+	Handle(const Handle<Class>& handle);
+	~Handle() { if (m_iptr) m_iptr->release(); }
+
+	Collected<Class>* collected() const { return m_iptr ? m_iptr->collected() : 0; }
+	Class& operator*() const { return collected()->instance; }
+	Class* operator->() const { return &collected()->instance; }
+	operator bool() const { return collected(); }
+
+	Handle& operator=(Collected<Class>* collected)
+	{
+		if (m_iptr)
+		{
+			Heap::overwritten(m_iptr->object());
+			m_iptr->m_data = reinterpret_cast<uintptr_t>(collected);
+		}
+		else if (collected)
+			m_iptr = new (Heap::heap(collected)) IndirectPointer<Class>(collected);
+		return *this;
+	}
+
+	template<typename T>
+	Handle& operator=(const Member<T, Class>& member)
+	{
+		return *this = member.collected();
+	}
+
+	Handle& operator=(const Handle<Class>& handle)
+	{
+		return *this = handle.collected();
+	}
+
+private:
+	IndirectPointer<Class>* m_iptr;
+};
+
+//! A reference to an object that doesn't keep it alive, for caches.  Marking doesn't trace weak
+//! handles: once it's done, the collection clears every weak handle whose object it didn't reach
+//! in a single pass over the heap's table of them, and after the pause calls the callbacks of the
+//! ones it cleared, which may use the heap.
+class WeakHandleBase
+{
+	friend class Heap;
+
+public:
+	typedef void (*Callback)(void* data);
+
+protected:
+	WeakHandleBase(CollectedBase* p, Callback cleared, void* data);
+	WeakHandleBase(const WeakHandleBase& weak);
+	~WeakHandleBase() { set(0); }
+
+	//! Copies the object and the callback, which is then called for both handles
+	WeakHandleBase& operator=(const WeakHandleBase& weak)
+	{
+		m_cleared = weak.m_cleared;
+		m_data = weak.m_data;
+		set(weak.get());
+		return *this;
+	}
+
+	//! The object, which a concurrent collection then has to keep even if it wasn't reachable when
+	//! marking began, since the mutator may store it anywhere
+	CollectedBase* get() const
+	{
+		Heap::overwritten(m_object);
+		return m_object;
+	}
+
+	void set(CollectedBase* p);
+
+private:
+	//! The heap whose table the handle is in, if it points at anything
+	Heap* m_heap;
+	CollectedBase* m_object;
+	size_t m_index;
+
+	Callback m_cleared;
+	void* m_data;
+};
+
+template<typename Class>
+class WeakHandle : public WeakHandleBase
+{
+public:
+	WeakHandle() : WeakHandleBase(0, 0, 0) {}
+
+	//! Points at ptr, calling cleared(data) after the pause that finds it dead
+	WeakHandle(Collected<Class>* ptr, Callback cleared = 0, void* data = 0) : WeakHandleBase(ptr, cleared, data) {}
+
+	//! The object, or 0 if it has been collected.  Keep it in a Handle to use it across allocations.
+	Collected<Class>* collected() const { return static_cast<Collected<Class>*>(get()); }
+	operator bool() const { return get(); }
+
+	WeakHandle& operator=(Collected<Class>* collected)
+	{
+		set(collected);
+		return *this;
+	}
+
+	WeakHandle& operator=(const WeakHandle<Class>& weak)
+	{
+		WeakHandleBase::operator=(weak);
+		return *this;
+	}
+};
+
+//! Makes the handles created inside of it cheap: rather than going through the heap's free list,
+//! their indirect pointers are bump allocated from pages belonging to the thread, and all freed at
+//! once when the scope closes.  Scopes nest, and must be closed in the reverse order they were
+//! opened, which automatic variables always are.
+//!
+//! A handle is inside of the innermost scope if it is constructed from an object while the scope is
+//! open, and it is an automatic variable below the scope on the stack, which assumes the stack grows
+//! down.  Any other handle escapes: one the scope's function returns, one in an enclosing frame or
+//! on the heap, or one that was empty when it was constructed, gets its indirect pointer from the
+//! free list and gives it back when it's destroyed.
+class HandleScope
+{
+public:
+	explicit HandleScope(Heap& heap);
+	~HandleScope();
+
+	//! Whether the handle at p dies before the scope does
+	bool contains(const void* p) const
+	{
+		return __builtin_frame_address(0) <= p && p < static_cast<const void*>(this);
+	}
+
+private:
+	HandleScope(const HandleScope&);
+	HandleScope& operator=(const HandleScope&);
+
+	AllocationContext* m_context;
+	HandleScope* m_previous;
+
+	//! Where the thread's scopes were allocating from when this one opened
+	size_t m_page;
+	size_t m_begin;
+};
+
+//! A stretch of code in which the thread doesn't touch the heap's objects or handles, like a
+//! blocking call, so that the pauses other threads take don't wait for it.  Leaving the region
+//! waits for any pause in progress to finish.
+class SafeRegion
+{
+public:
+	explicit SafeRegion(Heap& heap);
+	~SafeRegion();
+
+private:
+	SafeRegion(const SafeRegion&);
+	SafeRegion& operator=(const SafeRegion&);
+
+	Heap& m_heap;
+	AllocationContext* m_context;
+};
+
+template<typename Class>
+ObjectInfo<Class>* ObjectInfo<Class>::discovering = 0;
+
+template<typename Class>
+ObjectInfo<Class>::ObjectInfo()
+{
+	m_name = typeid(Class).name();
+	m_size = sizeof(Collected<Class>);
+	m_objectSize = m_size <= DataPage::MaxObjectSize ? SizeClasses[sizeClass(m_size)] : m_size;
+
+	if (TraceTable<Class>::Declared)
+	{
+		m_children = TraceTable<Class>::Offsets;
+		m_numChildren = TraceTable<Class>::Size;
+#ifndef NDEBUG
+		// A member left out of the list would never be marked, so check it against the prototype
+		discover();
+		std::vector<uintptr_t> declared(m_children, m_children + m_numChildren);
+		std::sort(declared.begin(), declared.end());
+		std::sort(m_offsets.begin(), m_offsets.end());
+		assert(declared == m_offsets);
+		std::vector<uintptr_t>().swap(m_offsets);
+#endif
+	}
+	else
+	{
+		discover();
+		m_children = m_offsets.data();
+		m_numChildren = m_offsets.size();
+	}
+
+	m_id = registerType(this);
+}
+
+//! Fills m_offsets from a prototype of the class, whose members append themselves as they are
+//! constructed.  The prototype is allocated rather than put on the stack, since a class can be large.
+template<typename Class>
+void ObjectInfo<Class>::discover()
+{
+	void* memory = ::operator new(sizeof(Collected<Class>));
+	discovering = this;
+	Collected<Class>* prototype = ::new (memory) Collected<Class>;
+	discovering = 0;
+
+	// Normalize the members' addresses to offsets from the beginning of a Collected<Class> object,
+	// rather than pointers into this one instance
+	for (size_t i = 0; i < m_offsets.size(); ++i)
+		m_offsets[i] -= reinterpret_cast<uintptr_t>(prototype);
+
+	prototype->~Collected<Class>();
+	::operator delete(memory);
+}
+
+template<typename Class>
+Handle<Class>::Handle(Collected<Class>* ptr)
+	: m_iptr(ptr ? new (Heap::heap(ptr), this) IndirectPointer<Class>(ptr) : 0)
+{
+}
+
+template<typename Class>
+Handle<Class>::Handle(const Handle<Class>& handle)
+	: m_iptr(0)
+{
+	if (Collected<Class>* ptr = handle.collected())
+		m_iptr = new (Heap::heap(ptr), this) IndirectPointer<Class>(ptr);
+}
+
+template<typename Class>
+inline void ObjectInfo<Class>::append(MemberBase<Class>* child)
+{
+	m_offsets.push_back(reinterpret_cast<uintptr_t>(child));
+}
+
+template<typename Class>
+MemberBase<Class>::MemberBase()
+	: m_reference(0)
+{
+#ifdef NDEBUG
+	// Declared members are only looked at to check the declaration, so the check folds away
+	if (TraceTable<Class>::Declared)
+		return;
+#endif
+
+	if (ObjectInfo<Class>* info = ObjectInfo<Class>::discovering)
+		info->append(this);
+}
+
+template<typename Class>
+ObjectInfo<Class> Collected<Class>::info;
+
+template<typename Class>
+void* Collected<Class>::operator new(size_t size, Heap& heap)
+{
+	assert(size == info.m_size);
+
+	AllocationContext* context = heap.context();
+	if (info.m_id < context->m_buffers.size())
+	{
+		if (void* o = context->m_buffers[info.m_id].allocate(info.m_objectSize))
+			return o;
+	}
+
+	return heap.allocateObject(info);
+}
+
+Heap::Heap(const HeapPolicy& policy)
+	: m_marker(0)
+	, m_evacuating(false)
+	, m_concurrentMarker(0)
+	, m_concurrentlyMarking(false)
+	, m_markingIncrementally(false)
+	, m_rootPage(0)
+	, m_rootIndex(0)
+	, m_id(nextHeapId())
+	, m_detaching(0)
+	, m_epoch(0)
+#ifdef CHOMPACT_COMPRESSED
+	, m_region(&compressedRegion(policy.m_hugePages))
+#else
+	, m_region(new Region(policy.m_reservation, policy.m_hugePages))
+#endif
+	, m_stopping(false)
+	, m_policy(policy)
+	, m_capacity(policy.m_initialCapacity)
+	, m_collections(0)
+	, m_liveBytes(0)
+	, m_bytesAllocated(0)
+	, m_largeObjectBytes(0)
+	, m_nextFreeIndirectPointerPage(0)
+	, m_nurseryBegin(0)
+	, m_nurseryTop(0)
+	, m_nurseryEnd(0)
+	, m_minorCollections(0)
+	, m_observer(0)
+	, m_observerData(0)
+	, m_pauses(0)
+	, m_bytesAllocatedAtCollection(0)
+	, m_recording(false)
+	, m_graph(0)
+{
+	m_indirectPointerPages.push_back(new (*m_region) IndirectPointerPage(this, 0, false));
+	addTypes();
+
+	// Promotion would move young objects out from under the stacks
+	size_t size = DIVU(m_policy.m_nurserySize, PageSize) * PageSize;
+	if (size && !m_policy.m_conservative)
+	{
+		m_nurseryBegin = m_nurseryTop = static_cast<char*>(m_region->allocate(size / PageSize));
+		m_nurseryEnd = m_nurseryBegin + size;
+	}
+
+	if (m_policy.m_markThreads > 1)
+		m_marker = new ParallelMarker(this, m_policy.m_markThreads);
+
+	std::lock_guard<std::mutex> lock(liveHeaps().m_lock);
+	liveHeaps().m_ids.push_back(m_id);
+}
+
+Heap::~Heap()
+{
+	{
+		LiveHeaps& heaps = liveHeaps();
+		std::unique_lock<std::mutex> lock(heaps.m_lock);
+		heaps.m_ids.erase(std::find(heaps.m_ids.begin(), heaps.m_ids.end(), m_id));
+		while (m_detaching)
+			heaps.m_detached.wait(lock);
+	}
+
+	if (m_concurrentlyMarking)
+	{
+		if (m_concurrentMarker)
+			m_concurrentMarker->stop();
+		--concurrentlyMarkedHeaps();
+	}
+	delete m_concurrentMarker;
+	delete m_marker;
+
+	for (size_t i = 0; i < m_weakHandles.size(); ++i)
+	{
+		m_weakHandles[i]->m_heap = 0;
+		m_weakHandles[i]->m_object = 0;
+	}
+
+	for (size_t i = 0; i < m_contexts.size(); ++i)
+		delete m_contexts[i];
+
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+	{
+		for (size_t i = 0; i < m_dataPages[t].m_pages.size(); ++i)
+			delete m_dataPages[t].m_pages[i];
+	}
+
+	for (size_t i = 0; i < m_freeDataPages.size(); ++i)
+		delete m_freeDataPages[i].first;
+
+	for (size_t i = 0; i < m_largeObjects.size(); ++i)
+		delete m_largeObjects[i];
+
+	for (size_t i = 0; i < m_indirectPointerPages.size(); ++i)
+		delete m_indirectPointerPages[i];
+
+	if (m_nurseryBegin)
+		m_region->release(m_nurseryBegin, (m_nurseryEnd - m_nurseryBegin) / PageSize);
+
+#ifndef CHOMPACT_COMPRESSED
+	delete m_region;
+#endif
+}
+
+void DataPage::operator delete(void* p)
+{
+	static_cast<DataPage*>(p)->heap()->region().release(p, 1);
+}
+
+void LargeObjectPage::operator delete(void* p)
+{
+	LargeObjectPage* page = static_cast<LargeObjectPage*>(p);
+	page->heap()->region().release(p, page->m_pages);
+}
+
+void IndirectPointerPage::operator delete(void* p)
+{
+	static_cast<IndirectPointerPage*>(p)->m_heap->region().release(p, 1);
+}
+
+bool Heap::marked(CollectedBase* p)
+{
+	if (PageHeader::pageHeader(p)->kind() == PageHeader::Large)
+		return LargeObjectPage::largeObjectPage(p)->marked(m_epoch);
+
+	DataPage* page = DataPage::dataPage(p);
+	return page->epoch() == m_epoch && page->marked(page->index(p));
+}
+
+void Heap::mark(CollectedBase* p)
+{
+	if (PageHeader::pageHeader(p)->kind() == PageHeader::Large)
+		return LargeObjectPage::largeObjectPage(p)->mark(m_epoch);
+
+	DataPage* page = DataPage::dataPage(p);
+	page->sweep(m_epoch);
+	page->mark(page->index(p));
+}
+
+bool Heap::markAtomic(CollectedBase* p)
+{
+	if (PageHeader::pageHeader(p)->kind() == PageHeader::Large)
+		return LargeObjectPage::largeObjectPage(p)->markAtomic(m_epoch);
+
+	DataPage* page = DataPage::dataPage(p);
+	page->sweepAtomic(m_epoch);
+	return page->markAtomic(page->index(p));
+}
+
+Heap* Heap::heap(CollectedBase* p)
+{
+	return PageHeader::pageHeader(p)->heap();
+}
+
+AllocationContext* Heap::attach()
+{
+	MutatorLock lock(this);
+
+	AllocationContext* context = 0;
+	for (size_t i = 0; i < m_contexts.size() && !context; ++i)
+	{
+		if (m_contexts[i]->m_thread == std::this_thread::get_id())
+			context = m_contexts[i];
+	}
+
+	if (context)
+		unblock(context);
+	else
+	{
+		context = new AllocationContext(this);
+		m_contexts.push_back(context);
+		attachedContexts().m_contexts.push_back(std::make_pair(m_id, context));
+	}
+
+	CurrentAllocationContext& current = currentAllocationContext();
+	current.m_heapId = m_id;
+	current.m_context = context;
+	return context;
+}
+
+void Heap::detach()
+{
+	CurrentAllocationContext& current = currentAllocationContext();
+	if (current.m_heapId != m_id)
+		return;
+
+	block(current.m_context);
+	current.m_heapId = 0;
+	current.m_context = 0;
+}
+
+AttachedContexts::~AttachedContexts()
+{
+	// The heaps are kept alive without holding the lock while the thread waits on them, since a
+	// pause may be waiting in turn for another exiting thread that wants the lock
+	LiveHeaps& heaps = liveHeaps();
+	std::vector<AllocationContext*> contexts;
+	{
+		std::lock_guard<std::mutex> lock(heaps.m_lock);
+		for (size_t i = 0; i < m_contexts.size(); ++i)
+		{
+			if (std::find(heaps.m_ids.begin(), heaps.m_ids.end(), m_contexts[i].first) == heaps.m_ids.end())
+				continue;
+			contexts.push_back(m_contexts[i].second);
+			++contexts.back()->m_heap->m_detaching;
+		}
+	}
+
+	// Every context is blocked before any is removed, so that no heap's pause waits for the thread
+	// while it waits for another's
+	for (size_t i = 0; i < contexts.size(); ++i)
+		contexts[i]->m_heap->exited(contexts[i]);
+	for (size_t i = 0; i < contexts.size(); ++i)
+	{
+		Heap* heap = contexts[i]->m_heap;
+		heap->removeContext(contexts[i]);
+
+		std::lock_guard<std::mutex> lock(heaps.m_lock);
+		--heap->m_detaching;
+		heaps.m_detached.notify_all();
+	}
+}
+
+void Heap::block(AllocationContext* context)
+{
+	if (m_policy.m_conservative)
+		saveStack(context);
+
+	std::lock_guard<std::mutex> lock(m_safepointLock);
+	context->m_state = AllocationContext::Blocked;
+	m_safepointChanged.notify_all();
+}
+
+void Heap::unblock(AllocationContext* context)
+{
+	std::unique_lock<std::mutex> lock(m_safepointLock);
+	while (m_stopping)
+		m_safepointChanged.wait(lock);
+	context->m_state = AllocationContext::Running;
+}
+
+void Heap::exited(AllocationContext* context)
+{
+	// A pause waits for a running thread before it scans its stack
+	std::unique_lock<std::mutex> lock(m_safepointLock);
+	while (context->m_state != AllocationContext::Running && m_stopping)
+		m_safepointChanged.wait(lock);
+	context->m_stackBase = 0;
+	context->m_state = AllocationContext::Blocked;
+	m_safepointChanged.notify_all();
+}
+
+void Heap::removeContext(AllocationContext* context)
+{
+	MutatorLock lock(this);
+
+	// The unallocated slots of the buffers are left for the next collection to reclaim
+	for (size_t t = 0; t < context->m_buffers.size(); ++t)
+	{
+		AllocationBuffer& buffer = context->m_buffers[t];
+		m_stats.m_bytesAllocated -= buffer.m_end - buffer.m_top;
+		buffer.reset();
+	}
+
+	m_remembered.insert(m_remembered.end(), context->m_remembered.begin(), context->m_remembered.end());
+	flushOverwritten(context);
+
+	// Every scope the thread opened has closed, so its pages become ordinary ones that the next
+	// collection releases
+	{
+		std::lock_guard<std::mutex> handleLock(m_handleLock);
+		for (size_t i = 0; i < context->m_scopePages.size(); ++i)
+		{
+			IndirectPointerPage* page = context->m_scopePages[i];
+			assert(!page->m_count);
+			page->m_scoped = false;
+			m_nextFreeIndirectPointerPage = std::min(m_nextFreeIndirectPointerPage, page->m_index);
+		}
+	}
+
+	CurrentAllocationContext& current = currentAllocationContext();
+	if (current.m_context == context)
+	{
+		current.m_heapId = 0;
+		current.m_context = 0;
+	}
+
+	m_contexts.erase(std::find(m_contexts.begin(), m_contexts.end(), context));
+	delete context;
+}
+
+void Heap::saveStack(AllocationContext* context)
+{
+	// The registers the callers were using are saved along with the stack that the thread is about
+	// to leave alone, since it may spill them somewhere below it while it waits
+	getcontext(&context->m_registers);
+	context->m_stackTop = reinterpret_cast<char*>(&context);
+}
+
+void Heap::stop()
+{
+	AllocationContext* context = this->context();
+	if (m_policy.m_conservative)
+		saveStack(context);
+
+	std::unique_lock<std::mutex> lock(m_safepointLock);
+	context->m_state = AllocationContext::Stopped;
+	m_safepointChanged.notify_all();
+	while (m_stopping)
+		m_safepointChanged.wait(lock);
+	context->m_state = AllocationContext::Running;
+}
+
+void Heap::stopMutators()
+{
+	AllocationContext* self = context();
+	std::unique_lock<std::mutex> lock(m_safepointLock);
+	m_stopping = true;
+	for (size_t i = 0; i < m_contexts.size(); ++i)
+	{
+		while (m_contexts[i] != self && m_contexts[i]->m_state == AllocationContext::Running)
+			m_safepointChanged.wait(lock);
+	}
+}
+
+void Heap::resumeMutators()
+{
+	std::lock_guard<std::mutex> lock(m_safepointLock);
+	m_stopping = false;
+	m_safepointChanged.notify_all();
+}
+
+Heap::MutatorLock::MutatorLock(Heap* heap)
+	: m_heap(heap)
+{
+	if (m_heap->m_lock.try_lock())
+		return;
+
+	// A thread that hasn't attached yet isn't waited for anyway
+	CurrentAllocationContext& current = currentAllocationContext();
+	AllocationContext* context = current.m_heapId == m_heap->m_id ? current.m_context : 0;
+	if (context)
+		m_heap->block(context);
+	m_heap->m_lock.lock();
+	if (context)
+		m_heap->unblock(context);
+}
+
+SafeRegion::SafeRegion(Heap& heap)
+	: m_heap(heap)
+	, m_context(heap.context())
+{
+	m_heap.block(m_context);
+}
+
+SafeRegion::~SafeRegion()
+{
+	m_heap.unblock(m_context);
+}
+
+void Heap::resetAllocationBuffers()
+{
+	for (size_t i = 0; i < m_contexts.size(); ++i)
+	{
+		for (size_t t = 0; t < m_contexts[i]->m_buffers.size(); ++t)
+		{
+			AllocationBuffer& buffer = m_contexts[i]->m_buffers[t];
+			m_stats.m_bytesAllocated -= buffer.m_end - buffer.m_top;
+			buffer.reset();
+		}
+	}
+
+	for (size_t t = 0; t < m_promotionBuffers.size(); ++t)
+		m_promotionBuffers[t].reset();
+}
+
+void Heap::addTypes()
+{
+	m_dataPages.resize(NumTypes);
+	m_promotionBuffers.resize(NumTypes);
+}
+
+bool Heap::claimNurseryPage(const TypeDescriptor& type, AllocationBuffer& buffer)
+{
+	if (m_nurseryTop == m_nurseryEnd)
+		return false;
+
+	DataPage* page = ::new (static_cast<void*>(m_nurseryTop)) DataPage(this, type, m_epoch);
+	m_nurseryTop += PageSize;
+
+	page->markRange(0, page->size());
+	buffer.m_top = static_cast<char*>(page->pointer(0));
+	buffer.m_end = static_cast<char*>(page->pointer(page->size()));
+	return true;
+}
+
+void Heap::collectNursery()
+{
+	MutatorLock lock(this);
+	PauseTimer timer(this, Pause::Minor);
+
+	// The slots are rewritten as the objects in them move, which the marker mustn't see halfway
+	if (m_concurrentlyMarking && !m_markingIncrementally)
+		m_concurrentMarker->stop();
+
+	// From here on, a mark on a nursery page means that the object has been promoted
+	resetAllocationBuffers();
+	for (char* page = m_nurseryBegin; page != m_nurseryTop; page += PageSize)
+		reinterpret_cast<DataPage*>(page)->clear();
+
+	std::vector<CollectedBase*> promoted;
+
+	for (size_t i = 0; i < m_indirectPointerPages.size(); ++i)
+	{
+		IndirectPointerPage* page = m_indirectPointerPages[i];
+		for (size_t j = page->next(0); j != IndirectPointerPage::Size; j = page->next(j + 1))
+		{
+			CollectedBase* p = page->m_handles[j].object();
+			if (young(p))
+				page->m_handles[j].m_data = reinterpret_cast<uintptr_t>(promote(p, promoted));
+		}
+	}
+
+	// A remembered slot may have been overwritten since, with anything.  The last set is the one
+	// left by the threads that have exited.
+	for (size_t i = 0; i <= m_contexts.size(); ++i)
+	{
+		std::vector<Reference*>& remembered = i < m_contexts.size() ? m_contexts[i]->m_remembered : m_remembered;
+		for (size_t j = 0; j < remembered.size(); ++j)
+		{
+			CollectedBase* p = decompress(*remembered[j]);
+			if (young(p))
+				*remembered[j] = compress(promote(p, promoted));
+		}
+		remembered.clear();
+	}
+	lap(m_pause.m_roots);
+
+	while (!promoted.empty())
+	{
+		CollectedBase* p = promoted.back();
+		promoted.pop_back();
+
+		std::pair<const uintptr_t*, const uintptr_t*> children = p->children();
+		for (const uintptr_t* offset = children.first; offset != children.second; ++offset)
+		{
+			Reference* slot = p->child(offset);
+			CollectedBase* q = decompress(*slot);
+			if (young(q))
+				*slot = compress(promote(q, promoted));
+		}
+	}
+	sweepWeakHandles(true);
+	lap(m_pause.m_mark);
+
+	m_nurseryTop = m_nurseryBegin;
+	m_bytesAllocatedAtCollection = m_stats.m_bytesAllocated;
+	++m_minorCollections;
+
+	if (m_concurrentlyMarking && !m_markingIncrementally)
+		m_concurrentMarker->start();
+}
+
+CollectedBase* Heap::promote(CollectedBase* p, std::vector<CollectedBase*>& promoted)
+{
+	// The first word of a promoted object is overwritten with its new address
+	DataPage* page = DataPage::dataPage(p);
+	if (!page->mark(page->index(p)))
+		return *reinterpret_cast<CollectedBase**>(p);
+
+	const TypeDescriptor& type = page->type();
+	AllocationBuffer& buffer = m_promotionBuffers[type.m_id];
+	void* copy = buffer.allocate(type.m_objectSize);
+	if (!copy)
+	{
+		if (!claimFreeRun(m_dataPages[type.m_id], buffer))
+		{
+			m_dataPages[type.m_id].m_pages.push_back(allocateDataPage(type));
+			claimFreeRun(m_dataPages[type.m_id], buffer);
+		}
+		copy = buffer.allocate(type.m_objectSize);
+	}
+
+	memcpy(copy, p, type.m_size);
+	*reinterpret_cast<CollectedBase**>(p) = static_cast<CollectedBase*>(copy);
+	++m_pause.m_objectsMarked;
+	m_pause.m_bytesMarked += type.m_objectSize;
+	if (!page->leaf())
+		promoted.push_back(static_cast<CollectedBase*>(copy));
+	return static_cast<CollectedBase*>(copy);
+}
+
+void Heap::chooseEvacuationCandidates()
+{
+	// The survivors of a page no more than half full fit on half a fresh page or less, so
+	// evacuating these frees at least twice what the copies take up
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+	{
+		const std::vector<DataPage*>& pages = m_dataPages[t].m_pages;
+		for (size_t i = 0; i < pages.size(); ++i)
+		{
+			if (pages[i]->live(m_epoch) * 2 > pages[i]->size())
+				continue;
+			pages[i]->m_evacuating = true;
+			m_evacuating = true;
+		}
+	}
+}
+
+bool Heap::evacuating(CollectedBase* p)
+{
+	PageHeader* page = PageHeader::pageHeader(p);
+	return page->kind() == PageHeader::Small && static_cast<DataPage*>(page)->m_evacuating;
+}
+
+CollectedBase* Heap::evacuate(CollectedBase* p)
+{
+	// Like a promoted object, the first word of an evacuated one is overwritten with its new address
+	DataPage* page = DataPage::dataPage(p);
+	page->sweep(m_epoch);
+	if (!page->mark(page->index(p)))
+		return *reinterpret_cast<CollectedBase**>(p);
+
+	// The free slots on the pages that stay may still hold objects that haven't been marked yet, so
+	// the copies go to fresh pages only
+	const TypeDescriptor& type = page->type();
+	AllocationBuffer& buffer = m_promotionBuffers[type.m_id];
+	void* copy = buffer.allocate(type.m_objectSize);
+	if (!copy)
+	{
+		DataPage* fresh = allocateDataPage(type);
+		m_dataPages[type.m_id].m_pages.push_back(fresh);
+		fresh->markRange(0, fresh->size());
+		buffer.m_top = static_cast<char*>(fresh->pointer(0));
+		buffer.m_end = static_cast<char*>(fresh->pointer(fresh->size()));
+		copy = buffer.allocate(type.m_objectSize);
+	}
+
+	memcpy(copy, p, type.m_size);
+	*reinterpret_cast<CollectedBase**>(p) = static_cast<CollectedBase*>(copy);
+	grey(static_cast<CollectedBase*>(copy));
+	return static_cast<CollectedBase*>(copy);
+}
+
+void Heap::releaseEvacuatedPages()
+{
+	for (size_t t = 0; t < m_promotionBuffers.size(); ++t)
+		m_promotionBuffers[t].reset();
+
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+	{
+		std::vector<DataPage*>& pages = m_dataPages[t].m_pages;
+		size_t kept = 0;
+		for (size_t i = 0; i < pages.size(); ++i)
+		{
+			if (pages[i]->m_evacuating)
+				releaseDataPage(pages[i]);
+			else
+				pages[kept++] = pages[i];
+		}
+		pages.resize(kept);
+	}
+	m_evacuating = false;
+}
+
+void Heap::collect()
+{
+	MutatorLock lock(this);
+	PauseTimer timer(this, Pause::Full);
+
+	if (m_concurrentlyMarking)
+		return finishConcurrentCollection();
+
+	assert(m_marking.empty());
+
+	// Only the old objects are traced and moved, so empty the nursery into them first
+	collectNursery();
+
+	// Objects are about to move, and everything that hasn't been allocated from the buffers is
+	// about to be reclaimed
+	resetAllocationBuffers();
+
+	// The graph is recorded as it is found, before the objects on evacuated pages would move
+	bool evacuates = m_policy.m_evacuate && !m_marker && !m_graph;
+	if (evacuates && fragmented())
+		chooseEvacuationCandidates();
+	if (m_policy.m_conservative)
+		scanStacks();
+
+	// Starting a new epoch unmarks everything without touching a single page.  The census begins
+	// first, since leaf stack roots are recorded as they are marked.
+	++m_epoch;
+	beginCensus();
+	markStackRoots();
+
+	if (m_marker && !m_graph)
+	{
+		m_marker->mark();
+		lap(m_pause.m_mark);
+	}
+	else
+		markFromRoots();
+	endCensus();
+	sweepWeakHandles(false);
+	if (m_evacuating)
+		releaseEvacuatedPages();
+
+	sweepLargeObjects();
+	if (!evacuates && !m_policy.m_conservative && fragmented())
+		compact();
+	else
+		releaseEmptyPages();
+	releaseEmptyIndirectPointerPages();
+
+	++m_collections;
+	resize();
+	lap(m_pause.m_sweep);
+}
+
+void Heap::markFromRoots()
+{
+	// mark roots
+	for (size_t i = 0; i < m_indirectPointerPages.size(); ++i)
+	{
+		IndirectPointerPage* page = m_indirectPointerPages[i];
+		for (size_t j = page->next(0); j != IndirectPointerPage::Size; j = page->next(j + 1))
+		{
+			CollectedBase* p = page->m_handles[j].object();
+			if (m_graph && p)
+				recordRoot(p);
+			if (!p)
+				continue;
+			if (m_evacuating && evacuating(p))
+				page->m_handles[j].m_data = reinterpret_cast<uintptr_t>(evacuate(p));
+			else if (!marked(p))
+			{
+				mark(p);
+				grey(p);
+			}
+		}
+	}
+	lap(m_pause.m_roots);
+
+	// mark children, refilling the prefetch queue from the stack as objects leave it
+	PrefetchQueue queue;
+	for (;;)
+	{
+		while (!queue.full() && !m_marking.empty())
+			queue.push(m_marking.pop());
+		if (queue.empty())
+			break;
+
+		markChildren(queue.pop());
+	}
+	lap(m_pause.m_mark);
+}
+
+void Heap::scanStacks()
+{
+	std::vector<PageHeader*> pages;
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+	{
+		const std::vector<DataPage*>& typePages = m_dataPages[t].m_pages;
+		pages.insert(pages.end(), typePages.begin(), typePages.end());
+	}
+	pages.insert(pages.end(), m_largeObjects.begin(), m_largeObjects.end());
+	std::sort(pages.begin(), pages.end());
+
+	AllocationContext* self = context();
+	for (size_t i = 0; i < m_contexts.size(); ++i)
+	{
+		AllocationContext* context = m_contexts[i];
+		if (context == self || !context->m_stackBase || !context->m_stackTop)
+			continue;
+		scanWords(&context->m_registers, &context->m_registers + 1, pages);
+		scanWords(context->m_stackTop, context->m_stackBase, pages);
+	}
+
+	// The callers' registers are either still in the registers, or saved by the calls since above
+	// this frame
+	ucontext_t registers;
+	getcontext(&registers);
+	scanWords(&registers, self->m_stackBase, pages);
+}
+
+void Heap::scanWords(const void* begin, const void* end, const std::vector<PageHeader*>& pages)
+{
+	if (pages.empty())
+		return;
+	char* low = reinterpret_cast<char*>(pages.front());
+	char* high = reinterpret_cast<char*>(pages.back()) + PageSize;
+	if (pages.back()->kind() == PageHeader::Large)
+		high = reinterpret_cast<char*>(pages.back()) + static_cast<LargeObjectPage*>(pages.back())->size();
+
+	uintptr_t first = DIVU(reinterpret_cast<uintptr_t>(begin), sizeof(void*)) * sizeof(void*);
+	for (char* const* word = reinterpret_cast<char* const*>(first); word < end; ++word)
+	{
+		char* p = *word;
+		if (p < low || p >= high)
+			continue;
+
+		PageHeader* page = *(std::upper_bound(pages.begin(), pages.end(), PageHeader::pageHeader(p)) - 1);
+		char* start = reinterpret_cast<char*>(page);
+		if (page->kind() == PageHeader::Large)
+		{
+			LargeObjectPage* large = static_cast<LargeObjectPage*>(page);
+			if (p >= static_cast<char*>(large->pointer()) && p < start + large->size())
+				m_stackRoots.push_back(static_cast<CollectedBase*>(large->pointer()));
+			continue;
+		}
+
+		// Only the slots that have been allocated are marked, and an interior pointer keeps the
+		// whole object
+		DataPage* data = static_cast<DataPage*>(page);
+		if (p >= start + PageSize || p < static_cast<char*>(data->pointer(0)))
+			continue;
+		size_t i = data->index(p);
+		if (i >= data->size() || data->epoch() != m_epoch || !data->marked(i))
+			continue;
+		data->m_evacuating = false;
+		m_stackRoots.push_back(static_cast<CollectedBase*>(data->pointer(i)));
+	}
+}
+
+void Heap::markStackRoots()
+{
+	for (size_t i = 0; i < m_stackRoots.size(); ++i)
+	{
+		CollectedBase* p = m_stackRoots[i];
+		if (m_graph)
+			recordRoot(p);
+		if (markAtomic(p))
+			grey(p);
+	}
+	m_stackRoots.clear();
+}
+
+void Heap::startConcurrentCollection()
+{
+	MutatorLock lock(this);
+	if (m_concurrentlyMarking)
+		return;
+	PauseTimer timer(this, Pause::Slice);
+
+	beginMarking();
+	m_markingIncrementally = false;
+
+	// The objects referenced from the roots are the grey objects the marker starts with
+	size_t budget = ~size_t(0);
+	markRoots(budget);
+	lap(m_pause.m_roots);
+
+	if (!m_concurrentMarker)
+		m_concurrentMarker = new ConcurrentMarker(this);
+	m_concurrentMarker->start();
+}
+
+bool Heap::collectIncremental(size_t budget)
+{
+	MutatorLock lock(this);
+	PauseTimer timer(this, Pause::Slice);
+	if (!m_concurrentlyMarking)
+	{
+		beginMarking();
+		m_markingIncrementally = true;
+	}
+
+	// A collection that was started concurrently is left to its marker
+	if (!m_markingIncrementally)
+	{
+		if (!m_concurrentMarker->parked())
+			return false;
+	}
+	else
+	{
+		bool rooted = markRoots(budget);
+		lap(m_pause.m_roots);
+		bool marked = rooted && markSome(budget);
+		lap(m_pause.m_mark);
+		if (!marked)
+			return false;
+	}
+
+	finishConcurrentCollection();
+	return true;
+}
+
+void Heap::beginMarking()
+{
+	assert(m_marking.empty());
+
+	// Marking doesn't look at young objects, so none can be holding on to the snapshot's objects
+	collectNursery();
+
+	// Marking is about to clear the marks on the pages lazily, which would lose track of the slots
+	// the buffers hold
+	resetAllocationBuffers();
+	if (m_policy.m_conservative)
+		scanStacks();
+	++m_epoch;
+	beginCensus();
+	markStackRoots();
+
+	// The pages allocated from now on are stamped with the new epoch, so their objects are born marked
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+		m_dataPages[t].m_firstNewPage = m_dataPages[t].m_pages.size();
+
+	m_rootPage = 0;
+	m_rootIndex = 0;
+
+	m_concurrentlyMarking = true;
+	++concurrentlyMarkedHeaps();
+}
+
+bool Heap::markRoots(size_t& budget)
+{
+	// Handles created after marking began can only point to objects that are either new or were
+	// reachable when it began, and handles that are overwritten before they are scanned are logged
+	// by the write barrier, so the handles can be scanned a few at a time
+	for (; m_rootPage < m_indirectPointerPages.size(); ++m_rootPage, m_rootIndex = 0)
+	{
+		IndirectPointerPage* page = m_indirectPointerPages[m_rootPage];
+		for (; (m_rootIndex = page->next(m_rootIndex)) != IndirectPointerPage::Size; ++m_rootIndex, --budget)
+		{
+			if (!budget)
+				return false;
+
+			CollectedBase* p = page->m_handles[m_rootIndex].object();
+			if (p && !young(p) && markAtomic(p))
+				grey(p);
+		}
+	}
+	return true;
+}
+
+void Heap::logOverwritten(CollectedBase* p)
+{
+	AllocationContext* c = context();
+	c->m_overwritten.push_back(p);
+	if (c->m_overwritten.size() >= OverwrittenBufferSize)
+		flushOverwritten(c);
+}
+
+void Heap::flushOverwritten(AllocationContext* context)
+{
+	std::lock_guard<std::mutex> lock(m_overwrittenLock);
+	m_overwritten.insert(m_overwritten.end(), context->m_overwritten.begin(), context->m_overwritten.end());
+	context->m_overwritten.clear();
+}
+
+bool Heap::markSome(size_t& budget)
+{
+	for (; budget; --budget)
+	{
+		if (m_marking.empty())
+		{
+			std::vector<CollectedBase*> overwritten;
+			{
+				std::lock_guard<std::mutex> lock(m_overwrittenLock);
+				overwritten.swap(m_overwritten);
+			}
+
+			for (size_t i = 0; i < overwritten.size(); ++i)
+			{
+				if (markAtomic(overwritten[i]))
+					grey(overwritten[i]);
+			}
+
+			if (m_marking.empty())
+				return true;
+		}
+
+		traceConcurrently(m_marking.pop());
+	}
+
+	return false;
+}
+
+void Heap::traceConcurrently(CollectedBase* p)
+{
+	record(p);
+	std::pair<const uintptr_t*, const uintptr_t*> children = m_children(p);
+	for (const uintptr_t* offset = children.first; offset != children.second; ++offset)
+	{
+		CollectedBase* q = decompress(__atomic_load_n(p->child(offset), __ATOMIC_ACQUIRE));
+		if (q && !young(q) && markAtomic(q))
+			grey(q);
+	}
+}
+
+void Heap::finishConcurrentCollection()
+{
+	MutatorLock lock(this);
+	PauseTimer timer(this, Pause::Full);
+	assert(m_concurrentlyMarking);
+
+	// The remembered slots may be in old objects that are about to be swept, and the next minor
+	// collection would write through them, so empty the nursery while they can still be trusted
+	collectNursery();
+
+	if (m_concurrentMarker)
+		m_concurrentMarker->stop();
+
+	// Finish the roots, and drain what the mutators have overwritten since the marker last looked
+	size_t budget = ~size_t(0);
+	markRoots(budget);
+	for (size_t i = 0; i < m_contexts.size(); ++i)
+		flushOverwritten(m_contexts[i]);
+	lap(m_pause.m_roots);
+	while (!markSome(budget = ~size_t(0)))
+		;
+	lap(m_pause.m_mark);
+	endCensus();
+	sweepWeakHandles(false);
+
+	m_concurrentlyMarking = false;
+	--concurrentlyMarkedHeaps();
+
+	// The buffers' unallocated slots were born marked, and are given back now instead of a
+	// collection later
+	resetAllocationBuffers();
+
+	sweepLargeObjects();
+	releaseEmptyPages();
+	releaseEmptyIndirectPointerPages();
+
+	++m_collections;
+	resize();
+	lap(m_pause.m_sweep);
+}
+
+void Heap::observe(void (*observer)(const Pause&, void*), void* data)
+{
+	MutatorLock lock(this);
+	m_observer = observer;
+	m_observerData = data;
+}
+
+Heap::PauseTimer::PauseTimer(Heap* heap, Pause::Kind kind)
+	: m_heap(heap)
+	, m_kind(kind)
+{
+	if (m_heap->m_pauses++)
+		return;
+
+	m_heap->stopMutators();
+	m_heap->m_pause = Pause();
+	m_heap->m_pause.m_kind = kind;
+	m_start = m_heap->m_lap = std::chrono::steady_clock::now();
+}
+
+Heap::PauseTimer::~PauseTimer()
+{
+	if (--m_heap->m_pauses)
+		return;
+
+	Pause& pause = m_heap->m_pause;
+	pause.m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+	m_heap->resumeMutators();
+
+	HeapStats& stats = m_heap->m_stats;
+	size_t microseconds = pause.m_seconds * 1e6;
+	size_t bucket = microseconds ? sizeof(microseconds) * 8 - __builtin_clzl(microseconds) : 0;
+	++stats.m_pauseHistogram[std::min(bucket, HeapStats::PauseBuckets - 1)];
+	++stats.m_pauses;
+	stats.m_pauseSeconds += pause.m_seconds;
+	stats.m_maxPause = std::max(stats.m_maxPause, pause.m_seconds);
+	stats.m_rootSeconds += pause.m_roots;
+	stats.m_markSeconds += pause.m_mark;
+	stats.m_sweepSeconds += pause.m_sweep;
+
+	if (m_heap->m_observer)
+		m_heap->m_observer(pause, m_heap->m_observerData);
+
+	std::vector<std::pair<void (*)(void*), void*> > cleared;
+	cleared.swap(m_heap->m_clearedWeakHandles);
+	for (size_t i = 0; i < cleared.size(); ++i)
+		cleared[i].first(cleared[i].second);
+}
+
+void Heap::lap(double& phase)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	phase += std::chrono::duration<double>(now - m_lap).count();
+	m_lap = now;
+}
+
+HeapStats Heap::stats()
+{
+	MutatorLock lock(this);
+
+	HeapStats stats = m_stats;
+	stats.m_collections = m_collections;
+	stats.m_minorCollections = m_minorCollections;
+	stats.m_bytesAllocatedSinceCollection = stats.m_bytesAllocated - m_bytesAllocatedAtCollection;
+	stats.m_liveBytes = m_liveBytes;
+	stats.m_capacity = m_capacity;
+
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+		stats.m_dataPages += m_dataPages[t].m_pages.size();
+	stats.m_freeDataPages = m_freeDataPages.size();
+	stats.m_nurseryPages = (m_nurseryTop - m_nurseryBegin) / PageSize;
+	stats.m_largeObjects = m_largeObjects.size();
+	{
+		std::lock_guard<std::mutex> lock(m_handleLock);
+		stats.m_indirectPointerPages = m_indirectPointerPages.size();
+		for (size_t i = 0; i < m_indirectPointerPages.size(); ++i)
+			stats.m_handles += m_indirectPointerPages[i]->m_count;
+	}
+	stats.m_fragmentation = fragmentation();
+	return stats;
+}
+
+std::vector<CensusEntry> Heap::census()
+{
+	MutatorLock lock(this);
+
+	std::vector<CensusEntry> census;
+	for (size_t t = 0; t < m_census.size(); ++t)
+	{
+		if (!m_census[t])
+			continue;
+		CensusEntry entry = { Types[t], m_census[t], m_census[t] * Types[t]->m_objectSize };
+		census.push_back(entry);
+	}
+	std::sort(census.begin(), census.end(), largerCensusEntry);
+	return census;
+}
+
+void Heap::dumpGraph(FILE* file)
+{
+	MutatorLock lock(this);
+
+	// A collection that is already marking has traced too much to record
+	if (m_concurrentlyMarking)
+		finishConcurrentCollection();
+
+	fwrite(GraphMagic, sizeof(GraphMagic), 1, file);
+	for (size_t t = 0; t < NumTypes; ++t)
+	{
+		uint8_t tag = GraphRecord::Type;
+		uint32_t id = t;
+		uint64_t size = Types[t]->m_size;
+		uint32_t length = strlen(Types[t]->m_name);
+		fwrite(&tag, sizeof(tag), 1, file);
+		fwrite(&id, sizeof(id), 1, file);
+		fwrite(&size, sizeof(size), 1, file);
+		fwrite(&length, sizeof(length), 1, file);
+		fwrite(Types[t]->m_name, 1, length, file);
+	}
+
+	m_graph = file;
+	collect();
+	m_graph = 0;
+	fflush(file);
+}
+
+void Heap::beginCensus()
+{
+	m_recording = m_policy.m_census || m_graph;
+	if (m_recording)
+		m_tally.assign(NumTypes, 0);
+}
+
+void Heap::endCensus()
+{
+	if (!m_recording)
+		return;
+
+	m_census.swap(m_tally);
+	m_recording = false;
+}
+
+void Heap::recordObject(CollectedBase* p)
+{
+	uint32_t type = PageHeader::pageHeader(p)->typeId();
+	++m_tally[type];
+	if (!m_graph)
+		return;
+
+	std::pair<const uintptr_t*, const uintptr_t*> children = m_children(p);
+	uint32_t count = 0;
+	for (const uintptr_t* offset = children.first; offset != children.second; ++offset)
+		count += *p->child(offset) != 0;
+
+	uint8_t tag = GraphRecord::Object;
+	uint64_t address = reinterpret_cast<uintptr_t>(p);
+	fwrite(&tag, sizeof(tag), 1, m_graph);
+	fwrite(&address, sizeof(address), 1, m_graph);
+	fwrite(&type, sizeof(type), 1, m_graph);
+	fwrite(&count, sizeof(count), 1, m_graph);
+	for (const uintptr_t* offset = children.first; offset != children.second; ++offset)
+	{
+		if (uint64_t child = reinterpret_cast<uintptr_t>(decompress(*p->child(offset))))
+			fwrite(&child, sizeof(child), 1, m_graph);
+	}
+}
+
+void Heap::recordRoot(CollectedBase* p)
+{
+	uint8_t tag = GraphRecord::Root;
+	uint64_t address = reinterpret_cast<uintptr_t>(p);
+	fwrite(&tag, sizeof(tag), 1, m_graph);
+	fwrite(&address, sizeof(address), 1, m_graph);
+}
+
+void Heap::resize()
+{
+	size_t objects = m_largeObjects.size();
+	m_liveBytes = m_largeObjectBytes;
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+	{
+		const std::vector<DataPage*>& pages = m_dataPages[t].m_pages;
+		for (size_t i = 0; i < pages.size(); ++i)
+		{
+			objects += pages[i]->live(m_epoch);
+			m_liveBytes += pages[i]->live(m_epoch) * Types[t]->m_objectSize;
+		}
+	}
+	m_bytesAllocated = 0;
+	m_stats.m_liveObjects = m_pause.m_objectsMarked = objects;
+	m_bytesAllocatedAtCollection = m_stats.m_bytesAllocated;
+	m_pause.m_bytesMarked = m_liveBytes;
+
+	// Grow geometrically while the live objects crowd the heap, and shrink back towards the
+	// target once they no longer do
+	if (m_liveBytes > m_policy.m_targetOccupancy * m_capacity)
+		m_capacity = std::max<size_t>(m_capacity * m_policy.m_growthFactor, m_liveBytes / m_policy.m_targetOccupancy);
+	else if (m_liveBytes * m_policy.m_growthFactor < m_policy.m_targetOccupancy * m_capacity)
+		m_capacity = std::max<size_t>(m_liveBytes / m_policy.m_targetOccupancy, m_policy.m_initialCapacity);
+
+	// The free pages are ordered by when they were emptied, so the ones past their decay are at the front
+	size_t expired = 0;
+	while (expired < m_freeDataPages.size() && m_freeDataPages[expired].second + m_policy.m_decay <= m_collections)
+		delete m_freeDataPages[expired++].first;
+	m_freeDataPages.erase(m_freeDataPages.begin(), m_freeDataPages.begin() + expired);
+}
+
+void Heap::markChildren(CollectedBase* p)
+{
+	assert(marked(p));
+	record(p);
+
+	std::pair<const uintptr_t*, const uintptr_t*> children = m_children(p);
+	for (const uintptr_t* offset = children.first; offset != children.second; ++offset)
+	{
+		Reference* slot = p->child(offset);
+		CollectedBase* q = decompress(*slot);
+		if (!q)
+			continue;
+		if (m_evacuating && evacuating(q))
+		{
+			*slot = compress(evacuate(q));
+			continue;
+		}
+		if (marked(q))
+			continue;
+		mark(q);
+		grey(q);
+	}
+}
+
+//! An object's forwarding address is implied by its rank among the live objects, so it can be
+//! computed from the mark bits alone rather than stored in the object.
+CollectedBase* Heap::forward(CollectedBase* p) const
+{
+	if (PageHeader::pageHeader(p)->kind() == PageHeader::Large)
+		return p;
+
+	DataPage* page = DataPage::dataPage(p);
+	size_t rank = page->m_liveBefore + page->countBefore(page->index(p));
+	const std::vector<DataPage*>& pages = m_dataPages[page->type().m_id].m_pages;
+	return static_cast<CollectedBase*>(pages[rank / page->size()]->pointer(rank % page->size()));
+}
+
+void Heap::forwardChildren(CollectedBase* p)
+{
+	std::pair<const uintptr_t*, const uintptr_t*> children = p->children();
+	for (const uintptr_t* offset = children.first; offset != children.second; ++offset)
+	{
+		Reference* child = p->child(offset);
+		if (*child)
+			*child = compress(forward(decompress(*child)));
+	}
+}
+
+void Heap::compact()
+{
+	std::vector<size_t> live(m_dataPages.size());
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+		live[t] = number(m_dataPages[t]);
+
+	// Point every reference at the new location, while the objects are still where the
+	// references say they are
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+	{
+		const std::vector<DataPage*>& pages = m_dataPages[t].m_pages;
+		for (size_t i = 0; i < pages.size(); ++i)
+		{
+			DataPage* page = pages[i];
+			for (size_t j = page->nextMarked(0); j < page->size(); j = page->nextMarked(j + 1))
+				forwardChildren(static_cast<CollectedBase*>(page->pointer(j)));
+		}
+	}
+
+	for (size_t i = 0; i < m_largeObjects.size(); ++i)
+		forwardChildren(static_cast<CollectedBase*>(m_largeObjects[i]->pointer()));
+
+	for (size_t i = 0; i < m_indirectPointerPages.size(); ++i)
+	{
+		IndirectPointerPage* page = m_indirectPointerPages[i];
+		for (size_t j = page->next(0); j != IndirectPointerPage::Size; j = page->next(j + 1))
+		{
+			CollectedBase* p = page->m_handles[j].object();
+			if (p)
+				page->m_handles[j].m_data = reinterpret_cast<uintptr_t>(forward(p));
+		}
+	}
+
+	for (size_t i = 0; i < m_weakHandles.size(); ++i)
+		m_weakHandles[i]->m_object = forward(m_weakHandles[i]->m_object);
+
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+		slide(m_dataPages[t], live[t]);
+}
+
+//! Number the survivors of a size class in page order, returning how many there are
+size_t Heap::number(TypePages& typePages)
+{
+	size_t live = 0;
+	for (size_t i = 0; i < typePages.m_pages.size(); ++i)
+	{
+		DataPage* page = typePages.m_pages[i];
+		page->sweep(m_epoch);
+		page->m_liveBefore = live;
+		live += page->count();
+	}
+	return live;
+}
+
+void Heap::slide(TypePages& typePages, size_t live)
+{
+	std::vector<DataPage*>& pages = typePages.m_pages;
+	if (pages.empty())
+		return;
+
+	const size_t size = pages.front()->size();
+	const size_t objectSize = pages.front()->objectSize();
+
+	// Slide the objects down.  An object is never moved past one that has not been moved yet,
+	// so visiting them in page order never overwrites a survivor.
+	size_t rank = 0;
+	for (size_t i = 0; i < pages.size(); ++i)
+	{
+		DataPage* page = pages[i];
+		for (size_t j = page->nextMarked(0); j < size; j = page->nextMarked(j + 1))
+		{
+			void* to = pages[rank / size]->pointer(rank % size);
+			if (to != page->pointer(j))
+				memmove(to, page->pointer(j), objectSize);
+			++rank;
+		}
+	}
+
+	// The survivors now fill the front of the size class, and the remaining pages are empty
+	size_t used = DIVU(live, size);
+	for (size_t i = 0; i < used; ++i)
+	{
+		DataPage* page = pages[i];
+		page->clear();
+		page->markRange(0, std::min(size, live - i * size));
+	}
+
+	for (size_t i = used; i < pages.size(); ++i)
+		releaseDataPage(pages[i]);
+	pages.resize(used);
+
+	typePages.m_nextFreeDataPage = live / size;
+	typePages.m_nextFreeObject = live % size;
+}
+
+bool Heap::claimFreeRun(TypePages& typePages, AllocationBuffer& buffer)
+{
+	for (; typePages.m_nextFreeDataPage != typePages.m_pages.size(); ++typePages.m_nextFreeDataPage, typePages.m_nextFreeObject = 0)
+	{
+		DataPage* dp = typePages.m_pages[typePages.m_nextFreeDataPage];
+
+		if (m_concurrentlyMarking && typePages.m_nextFreeDataPage < typePages.m_firstNewPage)
+		{
+			typePages.m_nextFreeDataPage = typePages.m_firstNewPage;
+			typePages.m_nextFreeObject = 0;
+			if (typePages.m_nextFreeDataPage == typePages.m_pages.size())
+				break;
+			dp = typePages.m_pages[typePages.m_nextFreeDataPage];
+		}
+
+		// This is where the page is swept, if nothing has touched it since the last collection
+		dp->sweep(m_epoch);
+		if (dp->full())
+			continue;
+
+		size_t begin = dp->nextFree(typePages.m_nextFreeObject);
+		if (begin == dp->size())
+			continue;
+		size_t end = dp->nextMarked(begin);
+
+		dp->markRange(begin, end);
+		buffer.m_top = static_cast<char*>(dp->pointer(begin));
+		buffer.m_end = static_cast<char*>(dp->pointer(end));
+		typePages.m_nextFreeObject = end;
+
+		m_bytesAllocated += buffer.m_end - buffer.m_top;
+		return true;
+	}
+
+	return false;
+}
+
+bool Heap::fragmented()
+{
+	return fragmentation() > m_policy.m_fragmentation;
+}
+
+double Heap::fragmentation()
+{
+	size_t occupied = 0, free = 0;
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+	{
+		const std::vector<DataPage*>& pages = m_dataPages[t].m_pages;
+		for (size_t i = 0; i < pages.size(); ++i)
+		{
+			size_t live = pages[i]->live(m_epoch);
+			if (!live)
+				continue;
+			occupied += pages[i]->size() * Types[t]->m_objectSize;
+			free += (pages[i]->size() - live) * Types[t]->m_objectSize;
+		}
+	}
+	return occupied ? double(free) / occupied : 0;
+}
+
+void Heap::releaseEmptyPages()
+{
+	for (size_t t = 0; t < m_dataPages.size(); ++t)
+	{
+		std::vector<DataPage*>& pages = m_dataPages[t].m_pages;
+		size_t occupied = 0;
+		for (size_t i = 0; i < pages.size(); ++i)
+		{
+			if (pages[i]->live(m_epoch))
+				pages[occupied++] = pages[i];
+			else
+				releaseDataPage(pages[i]);
+		}
+		pages.resize(occupied);
+
+		m_dataPages[t].m_nextFreeDataPage = 0;
+		m_dataPages[t].m_nextFreeObject = 0;
+		m_dataPages[t].m_firstNewPage = 0;
+	}
+}
+
+void* Heap::allocateObject(const TypeDescriptor& type)
+{
+	MutatorLock lock(this);
+
+	if (type.m_id >= m_dataPages.size())
+		addTypes();
+
+	if (type.m_size > DataPage::MaxObjectSize)
+		return allocateLargeObject(type);
+
+	// Each thread only grows its own buffers, since the other threads may be allocating from theirs
+	AllocationContext* context = this->context();
+	if (type.m_id >= context->m_buffers.size())
+		context->m_buffers.resize(NumTypes);
+
+	AllocationBuffer& buffer = context->m_buffers[type.m_id];
+	TypePages& typePages = m_dataPages[type.m_id];
+
+	if (void* object = buffer.allocate(type.m_objectSize))
+		return object;
+
+	if (m_nurseryBegin)
+	{
+		if (!claimNurseryPage(type, buffer))
+		{
+			collectNursery();
+
+			// The survivors may have filled the old objects' share of the heap
+			if (m_liveBytes + m_bytesAllocated > m_capacity)
+				collectAtCapacity();
+
+			claimNurseryPage(type, buffer);
+		}
+		return allocateRefilled(buffer, type);
+	}
+
+	if (claimFreeRun(typePages, buffer))
+		return allocateRefilled(buffer, type);
+
+	// Only collect once the heap is at capacity, otherwise it is cheaper to grow
+	if (m_liveBytes + m_bytesAllocated > m_capacity && collectAtCapacity())
+	{
+		if (claimFreeRun(typePages, buffer))
+			return allocateRefilled(buffer, type);
+	}
+
+	typePages.m_pages.push_back(allocateDataPage(type));
+	claimFreeRun(typePages, buffer);
+	return allocateRefilled(buffer, type);
+}
+
+void* Heap::allocateRefilled(AllocationBuffer& buffer, const TypeDescriptor& type)
+{
+	m_stats.m_bytesAllocated += buffer.m_end - buffer.m_top;
+	return buffer.allocate(type.m_objectSize);
+}
+
+DataPage* Heap::allocateDataPage(const TypeDescriptor& type)
+{
+	if (m_freeDataPages.empty())
+		return new (*m_region) DataPage(this, type, m_epoch);
+
+	// Reuse the most recently emptied page, it is the most likely to still be resident
+	DataPage* page = m_freeDataPages.back().first;
+	m_freeDataPages.pop_back();
+	return ::new (static_cast<void*>(page)) DataPage(this, type, m_epoch);
+}
+
+void Heap::releaseDataPage(DataPage* page)
+{
+	m_freeDataPages.push_back(std::make_pair(page, m_collections));
+}
+
+bool Heap::collectAtCapacity()
+{
+	if (!m_policy.m_concurrent)
 	{
-		m_marked[i / BitsPerWord] |= 1 << (i % BitsPerWord);
+		collect();
+		return true;
 	}
 
-	bool marked(size_t i) const
+	if (!m_concurrentlyMarking)
 	{
-		return m_marked[i / BitsPerWord] & 1 << (i % BitsPerWord);
+		startConcurrentCollection();
+		return false;
 	}
 
-	void clear()
+	// Keep growing while the marker catches up, unless the mutator is allocating so much faster
+	// that it is better to stop and wait for it
+	if ((!m_markingIncrementally && m_concurrentMarker->parked()) || m_liveBytes + m_bytesAllocated > m_capacity * m_policy.m_growthFactor)
 	{
-		memset(m_marked, '\0', DIVU(Size, BitsPerWord));
-		mark(Size - 1);
+		finishConcurrentCollection();
+		return true;
 	}
-};
+	return false;
+}
 
-//! To accomodate more advanced garbage collectors that will move objects, handles
-//! are references to indirect pointers, rather than directly to the objects themselves.
-class IndirectPointerBase
+void* Heap::allocateLargeObject(const TypeDescriptor& type)
 {
-public:
-	static const size_t Size = sizeof(uintptr_t) * 8;
-	union
-	{
-		struct
-		{
-			unsigned m_padding : Size - 1;
-			unsigned m_valid : 1;
-		};
-
-		unsigned m_data;
-	} u;
+	if (m_liveBytes + m_bytesAllocated + type.m_size > m_capacity)
+		collectAtCapacity();
 
-	void* operator new(size_t s, Heap* heap);
-};
+	LargeObjectPage* page = new (*m_region, type.m_size) LargeObjectPage(this, type, m_epoch);
+	m_largeObjects.push_back(page);
+	m_bytesAllocated += page->size();
+	m_stats.m_bytesAllocated += type.m_size;
 
+	return page->pointer();
+}
 
-//! The IndirectPointerPage is an array of IndirectPointer's that manages the removed
-//! items in a free list.
-class IndirectPointerPage
+void Heap::sweepLargeObjects()
 {
-public:
-	static const size_t Size = PageSize / sizeof(IndirectPointerBase) - 2 * sizeof(size_t);
-
-	size_t m_begin, m_freeList;
-	IndirectPointerBase m_handles[Size];
-
-	void* operator new(size_t s)
+	size_t live = 0;
+	for (size_t i = 0; i < m_largeObjects.size(); ++i)
 	{
-		assert(s <= PageSize);
-		return mmap(0, PageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		LargeObjectPage* page = m_largeObjects[i];
+		if (page->marked(m_epoch))
+		{
+			m_largeObjects[live++] = page;
+			continue;
+		}
+		delete page;
 	}
+	m_largeObjects.resize(live);
 
-	IndirectPointerPage()
-		: m_begin(1)
-		, m_freeList(0)
-	{
-	}
+	m_largeObjectBytes = 0;
+	for (size_t i = 0; i < m_largeObjects.size(); ++i)
+		m_largeObjectBytes += m_largeObjects[i]->size();
+}
 
-	void* allocateIndirectPointer()
+void* Heap::allocateIndirectPointer(const void* owner)
+{
+	AllocationContext* c = context();
+	if (c->m_scope && c->m_scope->contains(owner))
 	{
-		if (m_freeList)
-		{
-			uintptr_t allocated = m_freeList;
-			assert(m_handles[allocated].u.m_valid);
-
-			m_freeList = m_handles[allocated].u.m_data;
-
-			return &m_handles[allocated];
-		}
-		else if (m_begin <= Size)
-		{
-			return &m_handles[m_begin++];
-		}
-		else
+		// Bump allocate from the scope's pages, which stay around for the next scopes once the
+		// scope that added them has closed
+		for (;; ++c->m_scopePage)
 		{
-			return 0;
+			if (c->m_scopePage == c->m_scopePages.size())
+			{
+				std::lock_guard<std::mutex> lock(m_handleLock);
+				m_indirectPointerPages.push_back(new (*m_region) IndirectPointerPage(this, m_indirectPointerPages.size(), true));
+				c->m_scopePages.push_back(m_indirectPointerPages.back());
+			}
+			if (void* iptr = c->m_scopePages[c->m_scopePage]->allocateIndirectPointer())
+				return iptr;
 		}
 	}
-};
 
-template<typename Class>
-class IndirectPointer : public IndirectPointerBase
-{
-public:
-	IndirectPointer(Class* ptr)
+	std::lock_guard<std::mutex> lock(m_handleLock);
+
+	for (; m_nextFreeIndirectPointerPage != m_indirectPointerPages.size(); ++m_nextFreeIndirectPointerPage)
 	{
-		u.m_data = reinterpret_cast<uintptr_t>(ptr);
+		IndirectPointerPage* page = m_indirectPointerPages[m_nextFreeIndirectPointerPage];
+		if (page->m_scoped)
+			continue;
+		if (void* iptr = page->allocateIndirectPointer())
+			return iptr;
 	}
 
-	Class* operator->() const { return u.m_valid ? u.m_data : 0; }
-	Class& operator*() const { return u.m_valid ? u.m_data : 0; }
-};
+	m_indirectPointerPages.push_back(new (*m_region) IndirectPointerPage(this, m_indirectPointerPages.size(), false));
+	return m_indirectPointerPages.back()->allocateIndirectPointer();
+}
 
-class Heap
+void Heap::releaseEmptyIndirectPointerPages()
 {
-public:
-	Heap();
-
-	bool marked(CollectedBase*);
-	void mark(CollectedBase*);
+	size_t live = 0;
+	for (size_t i = 0; i < m_indirectPointerPages.size(); ++i)
+	{
+		IndirectPointerPage* page = m_indirectPointerPages[i];
+		if (!page->m_scoped && !page->m_count)
+		{
+			delete page;
+			continue;
+		}
+		page->m_index = live;
+		m_indirectPointerPages[live++] = page;
+	}
+	m_indirectPointerPages.resize(live);
+	m_nextFreeIndirectPointerPage = 0;
+}
 
-	static Heap* heap(CollectedBase*);
+void Heap::registerWeakHandle(WeakHandleBase* weak)
+{
+	std::lock_guard<std::mutex> lock(m_handleLock);
+	weak->m_index = m_weakHandles.size();
+	m_weakHandles.push_back(weak);
+}
 
-	void collect();
-	void markChildren(CollectedBase* p);
+void Heap::unregisterWeakHandle(WeakHandleBase* weak)
+{
+	std::lock_guard<std::mutex> lock(m_handleLock);
+	WeakHandleBase* last = m_weakHandles.back();
+	m_weakHandles[weak->m_index] = last;
+	last->m_index = weak->m_index;
+	m_weakHandles.pop_back();
+}
 
-	void* allocateObject(size_t size);
-	void* allocateIndirectPointer();
+void Heap::sweepWeakHandles(bool minor)
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < m_weakHandles.size(); ++i)
+	{
+		WeakHandleBase* weak = m_weakHandles[i];
+		CollectedBase* p = weak->m_object;
 
-private:
-	std::stack<CollectedBase*> m_marking;
+		// A minor collection leaves the old objects alone, and a full one the young ones, and a
+		// young object survives if it has been promoted
+		bool live;
+		if (!young(p))
+		{
+			live = minor || marked(p);
+			if (live && m_evacuating && evacuating(p))
+				weak->m_object = *reinterpret_cast<CollectedBase**>(p);
+		}
+		else if (!minor)
+			live = true;
+		else
+		{
+			DataPage* page = DataPage::dataPage(p);
+			live = page->marked(page->index(p));
+			if (live)
+				weak->m_object = *reinterpret_cast<CollectedBase**>(p);
+		}
 
-	std::vector<DataPage*> m_dataPages;
-	size_t m_nextFreeDataPage;
-	size_t m_nextFreeObject;
+		if (live)
+		{
+			weak->m_index = kept;
+			m_weakHandles[kept++] = weak;
+			continue;
+		}
 
-	std::vector<IndirectPointerPage*> m_indirectPointerPages;
-	size_t m_nextFreeIndirectPointerPage;
-};
+		weak->m_heap = 0;
+		weak->m_object = 0;
+		if (weak->m_cleared)
+			m_clearedWeakHandles.push_back(std::make_pair(weak->m_cleared, weak->m_data));
+	}
+	m_weakHandles.resize(kept);
+}
 
-//! Member<> is a wrapper around the data members of a class used to automatically
-//! generate the list of objects that need to be marked for each type.
-template<typename Class>
-class MemberBase
+void Heap::releaseIndirectPointer(IndirectPointerBase* iptr)
 {
-public:
-	MemberBase();
+	// The handle is as good as overwritten
+	overwritten(iptr->object());
 
-	void* m_ptr;
-};
+	std::lock_guard<std::mutex> lock(m_handleLock);
+	IndirectPointerPage* page = IndirectPointerPage::indirectPointerPage(iptr);
+	page->releaseIndirectPointer(iptr);
+	m_nextFreeIndirectPointerPage = std::min(m_nextFreeIndirectPointerPage, page->m_index);
+}
 
-template<typename Class>
-class ObjectInfo
+ParallelMarker::ParallelMarker(Heap* heap, size_t threads)
+	: m_heap(heap)
+	, m_threads(threads)
+	, m_generation(0)
+	, m_finished(0)
+	, m_stop(false)
+	, m_idle(0)
 {
-	friend class Collected<Class>;
-
-public:
-	ObjectInfo();
-	bool finalized();
-	void append(MemberBase<Class>*);
+	for (size_t i = 0; i < m_threads; ++i)
+		m_deques.push_back(new MarkDeque);
 
-private:
-	int m_numChildren;
-	bool m_initializing, m_finalized;
-	uintptr_t m_loader;
-	uintptr_t m_children[sizeof(Class) / sizeof(MemberBase<Class>)];
-};
+	// The thread that starts the collection is worker 0
+	for (size_t i = 1; i < m_threads; ++i)
+		m_workers.push_back(std::thread(&ParallelMarker::run, this, i));
+}
 
-class CollectedBase
+ParallelMarker::~ParallelMarker()
 {
-public:
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_start.notify_all();
 
-	virtual std::pair<CollectedBase**,CollectedBase**> children() = 0;
-};
+	for (size_t i = 0; i < m_workers.size(); ++i)
+		m_workers[i].join();
 
-template<typename Class>
-class Collected : public CollectedBase
+	for (size_t i = 0; i < m_deques.size(); ++i)
+		delete m_deques[i];
+}
+
+void ParallelMarker::mark()
 {
-public:
-	Collected()
 	{
-		// ASSERT that this pointer has been
-		// heap allocated
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_idle = 0;
+		m_finished = 0;
+		++m_generation;
 	}
+	m_start.notify_all();
 
-	void* operator new(size_t size, Heap&);
+	work(0);
 
-	Class instance;
-	static ObjectInfo<Class> info;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_finished != m_workers.size())
+		m_finish.wait(lock);
 
-	std::pair<CollectedBase**,CollectedBase**> children()
-	{
-		return std::make_pair(
-		          reinterpret_cast<CollectedBase**>(info.m_children),
-		          reinterpret_cast<CollectedBase**>(info.m_children) + info.m_numChildren);
-	}
-};
+	for (size_t i = 0; i < m_deques.size(); ++i)
+		m_deques[i]->reset();
+}
 
-//! Member is a wrapper around a pointer member of a c++ class.  The first template parameter
-//! is the type of the class that the member belongs to, while the second template parameter
-//! the type of the pointer member.  For example, in a class Dictionary, a pointer member to
-//! a type String would be Member<Dictionary, String>
-template<typename Class, typename Property>
-class Member : public MemberBase<Class>
+void ParallelMarker::run(size_t worker)
 {
-public:
-	Member() {}
-	Member(Collected<Property>*);
+	size_t generation = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (m_generation == generation && !m_stop)
+				m_start.wait(lock);
+			if (m_stop)
+				return;
+			generation = m_generation;
+		}
 
-	Property& operator*() const { return *reinterpret_cast<Property*>(MemberBase<Class>::m_ptr); }
-	Property* operator->() const { return reinterpret_cast<Property*>(MemberBase<Class>::m_ptr); }
-	operator bool() const { return MemberBase<Class>::m_ptr; }
+		work(worker);
 
-	 Member& operator=(Collected<Property>* collected)
-	{
-		MemberBase<Class>::m_ptr = collected;
-		return *this;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_finished;
+		}
+		m_finish.notify_one();
 	}
+}
 
-	template<typename T>
-	Member& operator=(const Member<T, Property>& handle)
-	{
-		MemberBase<Class>::m_ptr = handle.MemberBase<T>::m_ptr;
-		return *this;
-	}
+void ParallelMarker::work(size_t worker)
+{
+	MarkDeque& deque = *m_deques[worker];
 
-	Member& operator=(const Handle<Property>& handle)
+	// The roots found on the stacks are already marked
+	if (!worker)
 	{
-		MemberBase<Class>::m_ptr = handle.m_ptr;
-		return *this;
+		while (!m_heap->m_marking.empty())
+			deque.push(m_heap->m_marking.pop());
 	}
-};
-
-template<typename Class>
-class Handle
-{
-public:
-	Handle() : m_iptr(0) {}
-	Handle(Collected<Class>* ptr);
 
-	Class& operator*() const { return m_iptr ? *reinterpret_cast<Class*>(m_iptr->u.m_data) : NULL; }
-	Class* operator->() const { return m_iptr ? reinterpret_cast<Class*>(m_iptr->u.m_data) : NULL; }
-	operator bool() const { return m_iptr ? m_iptr->u.m_data : 0; }
+	// Objects are counted by type on the side if the heap is recording a census
+	std::vector<size_t> census(m_heap->m_recording ? NumTypes : 0);
+	size_t* counts = census.empty() ? 0 : &census[0];
 
-	Handle& operator=(Collected<Class>* collected)
+	// mark roots, striped across the markers a page at a time
+	const std::vector<IndirectPointerPage*>& pages = m_heap->m_indirectPointerPages;
+	for (size_t i = worker; i < pages.size(); i += m_threads)
 	{
-		if (m_iptr)
-			m_iptr->u.m_data = collected;
-		else
-			m_iptr = new (Heap::heap(collected)) IndirectPointer<Class>(&collected->instance);
-		return *this;
+		IndirectPointerPage* page = pages[i];
+		for (size_t j = page->next(0); j != IndirectPointerPage::Size; j = page->next(j + 1))
+		{
+			CollectedBase* p = page->m_handles[j].object();
+			if (p && m_heap->markAtomic(p))
+				grey(p, deque, counts);
+		}
 	}
 
-	template<typename T>
-	Handle& operator=(const Member<T, Class>& handle)
+	// mark children
+	ChildrenLookup children;
+	uint32_t random = worker + 1;
+	for (;;)
 	{
-		Collected<Class>* ptr = static_cast<Collected<Class>*>(handle.MemberBase<T>::m_ptr);
-		if (m_iptr)
-			m_iptr->u.m_data = reinterpret_cast<uintptr_t>(ptr);
-		else
-			m_iptr = new (Heap::heap(ptr)) IndirectPointer<Class>(&ptr->instance);
-		return *this;
+		while (CollectedBase* p = deque.take())
+			trace(p, deque, children, counts);
+
+		if (CollectedBase* p = steal(worker, random))
+			trace(p, deque, children, counts);
+		else if (terminate())
+			break;
 	}
 
-	Handle& operator=(const Handle<Class>& handle)
+	if (counts)
 	{
-		Collected<Class>* ptr = reinterpret_cast<Collected<Class>*>(handle.m_iptr);
-		if (m_iptr)
-			m_iptr->u.m_data = reinterpret_cast<uintptr_t>(ptr);
-		else
-			m_iptr = new (Heap::heap(ptr)) IndirectPointer<Class>(&ptr->instance);
-		return *this;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t t = 0; t < census.size(); ++t)
+			m_heap->m_tally[t] += census[t];
 	}
-
-private:
-	IndirectPointer<Class>* m_iptr;
-};
-
-template<typename Class>
-ObjectInfo<Class>::ObjectInfo()
-	: m_numChildren(0)
-	, m_initializing(true)
-{
-	// Create an object of type Class.  This instance is going to populate
-	// ObjectInfo<Class> with pointers to all of the reference members of Class.
-	Class c;
-
-	// Once we have a list of all of the reference members in Class, we normalize
-	// them to be integer offsets from the beginning of a Class object rather than
-	// direct pointers to a single instance.
-	for(size_t i = 0; i < m_numChildren; ++i)
-		m_children[i] -= reinterpret_cast<uintptr_t>(&c);
-#ifndef NDEBUG
-	std::cout << "resolving: " << typeid(*this).name() << std::endl;
-	for(size_t i = 0; i < m_numChildren; ++i)
-		std::cout << "child: " << m_children[i] << std::endl;
-	std::cout << std::string('*',20) << std::endl;
-#endif
-
-	// Finalize the object so that Member<Class,*> doesn't call ObjectInfo::append
-	// from the constructor anymore
-	m_finalized = true;
 }
 
-
-template<typename Class>
-Handle<Class>::Handle(Collected<Class>* ptr)
-	: m_iptr(new (Heap::heap(ptr)) IndirectPointer<Class>(&ptr->instance))
+void ParallelMarker::trace(CollectedBase* p, MarkDeque& deque, ChildrenLookup& lookup, size_t* census)
 {
-	// FIXME: for some reason, not having this line here causes us to not print
-	// out 
-	new (Heap::heap(ptr)) IndirectPointer<Class>(&ptr->instance);
+	if (census)
+		++census[PageHeader::pageHeader(p)->typeId()];
+
+	std::pair<const uintptr_t*, const uintptr_t*> children = lookup(p);
+	for (const uintptr_t* offset = children.first; offset != children.second; ++offset)
+	{
+		CollectedBase* q = decompress(*p->child(offset));
+		if (q && m_heap->markAtomic(q))
+			grey(q, deque, census);
+	}
 }
 
-template<typename Class>
-inline bool ObjectInfo<Class>::finalized()
+void ParallelMarker::grey(CollectedBase* p, MarkDeque& deque, size_t* census)
 {
-	return m_finalized;
+	PageHeader* page = PageHeader::pageHeader(p);
+	if (!page->leaf())
+		deque.push(p);
+	else if (census)
+		++census[page->typeId()];
 }
 
-template<typename Class>
-inline void ObjectInfo<Class>::append(MemberBase<Class>* child)
+CollectedBase* ParallelMarker::steal(size_t worker, uint32_t& random)
 {
-	if (!m_initializing)
-		return;
+	// Try every other marker once, starting from a random one
+	random ^= random << 13;
+	random ^= random >> 17;
+	random ^= random << 5;
 
-	m_children[m_numChildren++] = reinterpret_cast<uintptr_t>(child);
+	for (size_t i = 0; i < m_threads; ++i)
+	{
+		size_t victim = (random + i) % m_threads;
+		if (victim == worker)
+			continue;
+		if (CollectedBase* p = m_deques[victim]->steal())
+			return p;
+	}
+	return 0;
 }
 
-template<typename Class>
-MemberBase<Class>::MemberBase()
-	: m_ptr(0)
+//! A marker only goes idle once its own deque is empty, and only a busy marker can push, so once
+//! every marker is idle all of the deques are empty for good.
+bool ParallelMarker::terminate()
 {
-	if (Collected<Class>::info.finalized())
-		return;
+	++m_idle;
+	for (;;)
+	{
+		if (m_idle.load() == m_threads)
+			return true;
 
-	Collected<Class>::info.append(this);
+		for (size_t i = 0; i < m_threads; ++i)
+		{
+			if (!m_deques[i]->empty())
+			{
+				--m_idle;
+				return false;
+			}
+		}
+		std::this_thread::yield();
+	}
 }
 
-template<typename Class>
-ObjectInfo<Class> Collected<Class>::info;
-
-template<typename Class>
-void* Collected<Class>::operator new(size_t size, Heap& heap)
+ConcurrentMarker::ConcurrentMarker(Heap* heap)
+	: m_heap(heap)
+	, m_marking(false)
+	, m_exit(false)
+	, m_stop(false)
 {
-	void* o = heap.allocateObject(size);
-	return o;
+	m_thread = std::thread(&ConcurrentMarker::run, this);
 }
 
-Heap::Heap()
-	: m_nextFreeDataPage(0)
-	, m_nextFreeObject(0)
-	, m_nextFreeIndirectPointerPage(0)
+ConcurrentMarker::~ConcurrentMarker()
 {
-	m_dataPages.push_back(new DataPage(this));
-	m_dataPages.back()->clear();
-
-	m_indirectPointerPages.push_back(new IndirectPointerPage);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_exit = true;
+	}
+	m_wake.notify_one();
+	m_thread.join();
 }
 
-bool Heap::marked(CollectedBase* _p)
+void ConcurrentMarker::start()
 {
-	uintptr_t p = reinterpret_cast<uintptr_t>(_p);
-	return DataPage::dataPage(_p)->marked(p % DataPage::Size);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_marking = true;
+		m_stop = false;
+	}
+	m_wake.notify_one();
 }
 
-void Heap::mark(CollectedBase* _p)
+void ConcurrentMarker::stop()
 {
-	uintptr_t p = reinterpret_cast<uintptr_t>(_p);
-	DataPage::dataPage(_p)->mark(p % DataPage::Size);
+	m_stop = true;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_marking)
+		m_park.wait(lock);
 }
 
-Heap* Heap::heap(CollectedBase* _p)
+bool ConcurrentMarker::parked()
 {
-	uintptr_t p = reinterpret_cast<uintptr_t>(_p);
-	return DataPage::dataPage(_p)->heap();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return !m_marking;
 }
 
-void Heap::collect()
+void ConcurrentMarker::run()
 {
-	assert(m_marking.empty());
+	// Checking for a stop request between small slices keeps the pause that finishes marking short
+	const size_t Budget = 256;
 
-	// mark roots
-	for (size_t i = 0; i < m_indirectPointerPages.size(); ++i)
+	for (;;)
 	{
-		for (size_t j = 0; j < IndirectPointerPage::Size; ++j)
 		{
-			CollectedBase* p = reinterpret_cast<CollectedBase*>(m_indirectPointerPages[i]->m_handles[i].u.m_data);
-			mark(p);
-			markChildren(p);
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_marking && !m_exit)
+				m_wake.wait(lock);
+			if (m_exit)
+				return;
 		}
-	}
 
-	// mark children
-	while (!m_marking.empty())
-	{
-		CollectedBase* p = m_marking.top();
-		m_marking.pop();
+		size_t budget;
+		while (!m_stop && !m_heap->markSome(budget = Budget))
+			;
 
-		markChildren(p);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_marking = false;
+		}
+		m_park.notify_all();
 	}
+}
 
-	m_nextFreeDataPage = 0;
-	m_nextFreeObject = 0;
+void* IndirectPointerBase::operator new(size_t s, Heap* heap, const void* owner)
+{
+	assert(s == sizeof(uintptr_t));
+	return heap->allocateIndirectPointer(owner);
 }
 
-void Heap::markChildren(CollectedBase* p)
+void IndirectPointerBase::release()
 {
-	assert(marked(p));
-		return;
+	IndirectPointerPage* page = IndirectPointerPage::indirectPointerPage(this);
+	if (!page->m_scoped)
+		page->m_heap->releaseIndirectPointer(this);
+}
 
-	std::pair<CollectedBase**, CollectedBase**> children = p->children();
-	CollectedBase** begin = children.first;
-	CollectedBase** end = children.second;
-	for (CollectedBase** q = begin; q != end; ++q)
-	{
-		if (marked(p))
-			continue;
-		mark(p);
-		m_marking.push(*q);
-	}
+HandleScope::HandleScope(Heap& heap)
+	: m_context(heap.context())
+	, m_previous(m_context->m_scope)
+	, m_page(m_context->m_scopePage)
+	, m_begin(m_page < m_context->m_scopePages.size() ? m_context->m_scopePages[m_page]->m_begin : 1)
+{
+	m_context->m_scope = this;
 }
 
-void* Heap::allocateObject(size_t size)
+HandleScope::~HandleScope()
 {
-	DataPage* dp = m_dataPages[m_nextFreeDataPage];
+	assert(m_context->m_scope == this);
 
-	do
+	for (size_t i = m_page; i < m_context->m_scopePages.size() && i <= m_context->m_scopePage; ++i)
 	{
-		do
-		{
-			if (dp->marked(m_nextFreeObject))
-			{
-				dp->mark(m_nextFreeObject);
-				void* object = dp->pointer(m_nextFreeObject);
-				m_nextFreeObject++;
-
-				return object;
-			}
-			++m_nextFreeObject;
-		} while (m_nextFreeObject != DataPage::Size);
-		m_nextFreeObject = 0;
-		++m_nextFreeDataPage;
-	} while (m_nextFreeDataPage != m_dataPages.size());
+		IndirectPointerPage* page = m_context->m_scopePages[i];
+		size_t begin = i == m_page ? m_begin : 1;
 
-	// XXX increase the number of data pages
+		// The handles are as good as overwritten
+		for (size_t j = begin; j < page->m_begin; ++j)
+			Heap::overwritten(page->m_handles[j].object());
+		page->truncate(begin);
+	}
 
-	collect();
+	m_context->m_scopePage = m_page;
+	m_context->m_scope = m_previous;
 }
 
-void* Heap::allocateIndirectPointer()
+WeakHandleBase::WeakHandleBase(CollectedBase* p, Callback cleared, void* data)
+	: m_heap(0)
+	, m_object(0)
+	, m_cleared(cleared)
+	, m_data(data)
 {
-	void* iptr;
-	IndirectPointerPage* page;
-	do
-	{
-		page = m_indirectPointerPages[m_nextFreeIndirectPointerPage]; 
-		iptr = page->allocateIndirectPointer();
-
-		if (iptr)
-			return iptr;
+	set(p);
+}
 
-		++m_nextFreeIndirectPointerPage;
-	} while(m_nextFreeIndirectPointerPage != m_indirectPointerPages.size());
+WeakHandleBase::WeakHandleBase(const WeakHandleBase& weak)
+	: m_heap(0)
+	, m_object(0)
+	, m_cleared(weak.m_cleared)
+	, m_data(weak.m_data)
+{
+	set(weak.get());
 }
 
-void* IndirectPointerBase::operator new(size_t s, Heap* heap)
+void WeakHandleBase::set(CollectedBase* p)
 {
-	assert(s == sizeof(uintptr_t));
-	heap->allocateIndirectPointer();
+	Heap* heap = p ? Heap::heap(p) : 0;
+	if (heap != m_heap)
+	{
+		if (m_heap)
+			m_heap->unregisterWeakHandle(this);
+		if (heap)
+			heap->registerWeakHandle(this);
+		m_heap = heap;
+	}
+	m_object = p;
 }
 
 
@@ -562,6 +4384,10 @@ struct List
 	Member<List, List> next;
 };
 
+CHOMPACT_TRACE(List, next)
+
+// Programs built on the collector, like the benchmarks, include this file with CHOMPACT_NO_MAIN
+#ifndef CHOMPACT_NO_MAIN
 int main()
 {
 	Heap heap;
@@ -577,11 +4403,11 @@ int main()
 		list->data = i;
 	}
 
-	// heap.collect();
+	heap.collect();
 
 	for (list = head; list; list = list->next)
 	{
 		std::cout << list->data << std::endl;
 	}
 }
-
+#endif
@@ -23,13 +23,10 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <cstddef>
 #include <iostream>
 #include <stdint.h>
-#include <vector>
-
-#ifndef NDEBUG
-#include <typeinfo>
-#endif
+#include <utility>
 
 #define DynamicClass(C) \
 	template<typename IdType> class C##Impl; \
@@ -42,54 +39,59 @@
 #define extends ,
 #define Dyn(C) DynamicWrapper< C >
 #define DynId(C) C::IdType
-#define DynInfo(C) DynamicObjectInfo<DynId(Class)>::info
 
 class DynamicBase;
 template<typename Class> class DynamicWrapper;
 
-//! TODO
-template<typename ClassId>
-class ObjectInfo
-{
-public:
-	ObjectInfo()
-		: finalized(false)
-	{
-	}
-
-	void populate(uintptr_t base)
-	{
-		if (finalized)
-			return;
-		// Create an object of type Class.  This instance is going to populate
-		// ObjectInfo<Class> with pointers to all of the reference members of Class.
-		// Once we have a list of all of the reference members in Class, we normalize
-		// them to be integer offsets from the beginning of a Class object rather than
-		// direct pointers to a single instance.
-		for(size_t i = 0; i < children.size(); ++i)
-			children[i] -= base;
-#ifndef NDEBUG
-		std::cout << "resolving: " << typeid(*this).name() << std::endl;
-		for(size_t i = 0; i < children.size(); ++i)
-			std::cout << "child: " << children[i] << std::endl;
-#endif
-
-		// Finalize the object so that Member<Class,*> doesn't call ObjectInfo::append
-		// from the constructor anymore
-		finalized = true;
-	}
-
-	bool finalized;
-	std::vector<uintptr_t> children;
-};
-
-//! TODO
+//! The reference members of a dynamic class, as offsets from the start of its DynamicWrapper.  Every
+//! dynamic class declares them with DynamicTrace, so nothing is discovered at startup, and a class
+//! that doesn't fails to compile as soon as it is wrapped.
 template<typename ClassId>
-struct DynamicObjectInfo
-{
-	static ObjectInfo<ClassId> info;
-};
-template<typename ClassId> ObjectInfo<ClassId> DynamicObjectInfo<ClassId>::info;
+struct TraceTable;
+
+//! Declares the reference members of a dynamic class, at namespace scope after the class, listing up
+//! to 16 members, or none:
+//!
+//!     DynamicTrace(List, next)
+//!
+//! Dynamic classes are polymorphic, and offsetof is only conditionally supported on them, but GCC and
+//! Clang support it for classes without virtual bases, which a dynamic class never has.  The table
+//! ends with an unused zero, so that it isn't empty when the class has no members.
+#define DynamicTrace(C, ...) \
+	template<> \
+	struct TraceTable<DynId(C)> \
+	{ \
+		static const uintptr_t Offsets[]; \
+		static const size_t Size = DynamicCount(C, ##__VA_ARGS__); \
+	}; \
+	_Pragma("GCC diagnostic push") \
+	_Pragma("GCC diagnostic ignored \"-Winvalid-offsetof\"") \
+	const uintptr_t TraceTable<DynId(C)>::Offsets[] = { DynamicForEach(DynamicOffset, C, ##__VA_ARGS__) 0 }; \
+	_Pragma("GCC diagnostic pop")
+
+#define DynamicOffset(C, member) offsetof(Dyn(C), member),
+#define DynamicCat(a, b) DynamicCat_(a, b)
+#define DynamicCat_(a, b) a##b
+#define DynamicCount(C, ...) DynamicCount_(C, ##__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define DynamicCount_(C, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define DynamicForEach(M, C, ...) DynamicCat(DynamicForEach_, DynamicCount(C, ##__VA_ARGS__))(M, C, ##__VA_ARGS__)
+#define DynamicForEach_0(M, C, ...)
+#define DynamicForEach_1(M, C, a) M(C, a)
+#define DynamicForEach_2(M, C, a, ...) M(C, a) DynamicForEach_1(M, C, __VA_ARGS__)
+#define DynamicForEach_3(M, C, a, ...) M(C, a) DynamicForEach_2(M, C, __VA_ARGS__)
+#define DynamicForEach_4(M, C, a, ...) M(C, a) DynamicForEach_3(M, C, __VA_ARGS__)
+#define DynamicForEach_5(M, C, a, ...) M(C, a) DynamicForEach_4(M, C, __VA_ARGS__)
+#define DynamicForEach_6(M, C, a, ...) M(C, a) DynamicForEach_5(M, C, __VA_ARGS__)
+#define DynamicForEach_7(M, C, a, ...) M(C, a) DynamicForEach_6(M, C, __VA_ARGS__)
+#define DynamicForEach_8(M, C, a, ...) M(C, a) DynamicForEach_7(M, C, __VA_ARGS__)
+#define DynamicForEach_9(M, C, a, ...) M(C, a) DynamicForEach_8(M, C, __VA_ARGS__)
+#define DynamicForEach_10(M, C, a, ...) M(C, a) DynamicForEach_9(M, C, __VA_ARGS__)
+#define DynamicForEach_11(M, C, a, ...) M(C, a) DynamicForEach_10(M, C, __VA_ARGS__)
+#define DynamicForEach_12(M, C, a, ...) M(C, a) DynamicForEach_11(M, C, __VA_ARGS__)
+#define DynamicForEach_13(M, C, a, ...) M(C, a) DynamicForEach_12(M, C, __VA_ARGS__)
+#define DynamicForEach_14(M, C, a, ...) M(C, a) DynamicForEach_13(M, C, __VA_ARGS__)
+#define DynamicForEach_15(M, C, a, ...) M(C, a) DynamicForEach_14(M, C, __VA_ARGS__)
+#define DynamicForEach_16(M, C, a, ...) M(C, a) DynamicForEach_15(M, C, __VA_ARGS__)
 
 //! Member<> is a wrapper around the data members of a class used to automatically
 //! generate the list of objects that need to be marked for each type.
@@ -100,10 +102,6 @@ public:
 	MemberBase()
 		: m_ptr(0)
 	{
-		if (DynamicObjectInfo<ClassId>::info.finalized)
-			return;
-
-		DynamicObjectInfo<ClassId>::info.children.push_back(reinterpret_cast<uintptr_t>(this));
 	}
 
 	void* m_ptr;
@@ -144,7 +142,8 @@ public:
 class DynamicBase
 {
 public:
-	virtual std::pair<DynamicBase**,DynamicBase**> children() = 0;
+	//! The offsets of the reference members, relative to the start of the object
+	virtual std::pair<const uintptr_t*, const uintptr_t*> children() = 0;
 };
 
 //! TODO
@@ -152,16 +151,10 @@ template<typename Class>
 class DynamicWrapper : public Class::DynImpl
 {
 public:
-	DynamicWrapper()
+	std::pair<const uintptr_t*, const uintptr_t*> children()
 	{
-		DynamicObjectInfo<typename Class::IdType>::info.populate(reinterpret_cast<uintptr_t>(this));
-	}
-
-	std::pair<DynamicBase**,DynamicBase**> children()
-	{
-		return std::make_pair(
-		          reinterpret_cast<DynamicBase**>(&DynamicObjectInfo<typename Class::IdType>::info.children.front()),
-		          reinterpret_cast<DynamicBase**>(&DynamicObjectInfo<typename Class::IdType>::info.children.back()));
+		typedef TraceTable<typename Class::IdType> Table;
+		return std::make_pair(Table::Offsets, Table::Offsets + Table::Size);
 	}
 };
 
@@ -172,6 +165,8 @@ public:
 	DynamicMember(List) next;
 };
 
+DynamicTrace(List, next)
+
 
 int main()
 {
@@ -0,0 +1,122 @@
+//! Converts an object graph written by Heap::dumpGraph into a DOT file, which graphviz can lay out.
+//! Every object becomes a node labelled with its class, and the handles become edges from a single
+//! node for the roots.
+//
+//   graph2dot heap.graph > heap.dot && dot -Tsvg heap.dot > heap.svg
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <cxxabi.h>
+#include <stdint.h>
+
+//! Mirrors GraphRecord in chompact.cpp, which this doesn't include to stay free of the heap
+const char GraphMagic[8] = { 'c', 'h', 'o', 'm', 'p', 'g', 'r', '1' };
+enum Tag { Type = 'T', Root = 'R', Object = 'O' };
+
+template<typename T>
+bool read(FILE* file, T& value)
+{
+	return fread(&value, sizeof(value), 1, file) == 1;
+}
+
+std::string demangle(const std::string& name)
+{
+	int status;
+	char* demangled = abi::__cxa_demangle(name.c_str(), 0, 0, &status);
+	if (!demangled)
+		return name;
+	std::string result(demangled);
+	free(demangled);
+	return result;
+}
+
+//! Escapes a class name for a DOT string, whose only special characters are quotes and backslashes
+std::string quote(const std::string& s)
+{
+	std::string result("\"");
+	for (size_t i = 0; i < s.size(); ++i)
+	{
+		if (s[i] == '"' || s[i] == '\\')
+			result += '\\';
+		result += s[i];
+	}
+	return result + '"';
+}
+
+//! Reports a record that the file ends partway through
+int truncated(char tag)
+{
+	fprintf(stderr, "truncated record '%c'\n", tag);
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	FILE* file = argc > 1 ? fopen(argv[1], "rb") : stdin;
+	if (!file)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	char magic[sizeof(GraphMagic)];
+	if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, GraphMagic, sizeof(magic)))
+	{
+		fprintf(stderr, "not an object graph\n");
+		return 1;
+	}
+
+	printf("digraph heap {\n\tnode [shape=box];\n\troots [shape=ellipse];\n");
+
+	std::vector<std::string> names;
+	uint8_t tag;
+	while (read(file, tag))
+	{
+		if (tag == Type)
+		{
+			uint32_t id, length;
+			uint64_t size;
+			if (!read(file, id) || !read(file, size) || !read(file, length))
+				return truncated(tag);
+			std::string name(length, '\0');
+			if (length && fread(&name[0], length, 1, file) != 1)
+				return truncated(tag);
+			if (names.size() <= id)
+				names.resize(id + 1);
+			names[id] = quote(demangle(name));
+		}
+		else if (tag == Root)
+		{
+			uint64_t address;
+			if (!read(file, address))
+				return truncated(tag);
+			printf("\troots -> n%llx;\n", (unsigned long long)address);
+		}
+		else if (tag == Object)
+		{
+			uint64_t address;
+			uint32_t type, count;
+			if (!read(file, address) || !read(file, type) || !read(file, count))
+				return truncated(tag);
+			printf("\tn%llx [label=%s];\n", (unsigned long long)address, type < names.size() ? names[type].c_str() : "\"?\"");
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				uint64_t child;
+				if (!read(file, child))
+					return truncated(tag);
+				printf("\tn%llx -> n%llx;\n", (unsigned long long)address, (unsigned long long)child);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "unknown record '%c'\n", tag);
+			return 1;
+		}
+	}
+
+	printf("}\n");
+	return ferror(file) ? 1 : 0;
+}